@@ -12,10 +12,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
 
 #define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
 #define LINE_BUF_SIZE 4096
 #define BLOCK_BUF_SIZE (4 * 1024 * 1024)
+#define LISTEN_FDS_START 3    // systemdと同じく、渡されるリスニングソケットは3番から並ぶ
+#define MAX_LISTEN_FDS 16
+#define KEEPALIVE_TIMEOUT 5   // 次のリクエストを待つ秒数
 
 typedef void (*sighandler_t)(int);
 
@@ -31,6 +37,7 @@ struct HTTPHeaderField {
 
 struct HTTPRequest {
     int protocol_minor_version;
+    int keep_alive;     // レスポンスを返した後も同じ接続で次のリクエストを待つ
     char *method;
     char *path;
     struct HTTPHeaderField *header;
@@ -48,42 +55,150 @@ static void install_signal_handlers(void);
 
 static void service(FILE *in, FILE *out, char *docroot);
 
+static int listen_fds(void);
+
+static void server_main(int nfds, char *docroot);
+
 int main(int argc, char *argv[]) {
+    int nfds;
+
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <docroot>\n", argv[0]);
         exit(1);
     }
 
     install_signal_handlers();
-    service(stdin, stdout, argv[1]);
+    // リスニングソケットを渡されたら自分で受け付ける。なければinetdと同じく標準入出力が接続
+    nfds = listen_fds();
+    if (nfds > 0) {
+        server_main(nfds, argv[1]);
+    } else {
+        service(stdin, stdout, argv[1]);
+    }
     exit(0);
 }
 
+// LISTEN_FDS/LISTEN_PIDで渡されたリスニングソケットの数。自分宛てでなければ0
+static int listen_fds(void) {
+    char *fds, *pid;
+    int n;
+
+    fds = getenv("LISTEN_FDS");
+    pid = getenv("LISTEN_PID");
+    if (!fds || (pid && atoi(pid) != getpid())) {
+        return 0;
+    }
+    n = atoi(fds);
+    if (n > MAX_LISTEN_FDS) {
+        log_exit("too many listening sockets: %d", n);
+    }
+    return n < 0 ? 0 : n;
+}
+
+static void detach_children(void);
+
+// 接続ごとにforkして子プロセスでservice()を動かす。execは最初の1回だけで済む
+static void server_main(int nfds, char *docroot) {
+    struct pollfd pfds[MAX_LISTEN_FDS];
+    int i;
+
+    detach_children();
+    for (i = 0; i < nfds; i++) {
+        pfds[i].fd = LISTEN_FDS_START + i;
+        pfds[i].events = POLLIN;
+        // 他のプロセスと同じソケットを待っていても、先に取られたらaccept(2)で止まらないようにする
+        fcntl(pfds[i].fd, F_SETFL, fcntl(pfds[i].fd, F_GETFL) | O_NONBLOCK);
+    }
+    for (;;) {
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_exit("poll(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < nfds; i++) {
+            int sock;
+            pid_t pid;
+
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            sock = accept(pfds[i].fd, NULL, NULL);
+            if (sock < 0) {
+                if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                    log_exit("accept(2) failed: %s", strerror(errno));
+                }
+                continue;
+            }
+            pid = fork();
+            if (pid < 0) {
+                log_exit("fork(2) failed: %s", strerror(errno));
+            }
+            if (pid == 0) {
+                FILE *in, *out;
+                int j;
+
+                for (j = 0; j < nfds; j++) {
+                    close(pfds[j].fd);
+                }
+                in = fdopen(sock, "r");
+                out = fdopen(dup(sock), "w");
+                if (!in || !out) {
+                    log_exit("fdopen(3) failed: %s", strerror(errno));
+                }
+                service(in, out, docroot);
+                exit(0);
+            }
+            close(sock);
+        }
+    }
+}
+
 static struct HTTPRequest *read_request(FILE *in);
 
 static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
 
 static void free_request(struct HTTPRequest *req);
 
+// クライアントが閉じるか、keep-aliveでなくなるか、次のリクエストが来なくなるまで応答し続ける
 static void service(FILE *in, FILE *out, char *docroot) {
     struct HTTPRequest *req;
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    struct timeval timeout = {KEEPALIVE_TIMEOUT, 0};
+    int keep_alive;
+
+    // ソケットでなければEBADFかENOTSOCKで失敗するだけ
+    setsockopt(fileno(in), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    do {
+        req = read_request(in);
+        if (!req) {
+            break;
+        }
+        respond_to(req, out, docroot);
+        keep_alive = req->keep_alive;
+        free_request(req);
+    } while (keep_alive);
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in);
+static int read_request_line(struct HTTPRequest *req, FILE *in);
 
 static struct HTTPHeaderField *read_header_field(FILE *in);
 
 static long content_length(struct HTTPRequest *req);
 
+static int request_keep_alive(struct HTTPRequest *req);
+
+static char *lookup_header_field_value(struct HTTPRequest *req, char *name);
+
+// 次のリクエストが届かないまま接続が閉じるかタイムアウトしたらNULLを返す
 static struct HTTPRequest *read_request(FILE *in) {
     struct HTTPRequest *req;
     struct HTTPHeaderField *h;
 
     req = xmalloc(sizeof(struct HTTPRequest));
-    read_request_line(req, in);
+    if (!read_request_line(req, in)) {
+        free(req);
+        return NULL;
+    }
 
     req->header = NULL;
     while ((h = read_header_field(in)) != NULL) {
@@ -91,6 +206,14 @@ static struct HTTPRequest *read_request(FILE *in) {
         req->header = h;
     }
 
+    req->keep_alive = request_keep_alive(req);
+    // chunkedは解釈できずボディの終わりが分からないので、ボディは読まずにrespond_to()で501を返して接続を閉じる
+    if (lookup_header_field_value(req, "Transfer-Encoding")) {
+        req->keep_alive = 0;
+        req->length = 0;
+        req->body = NULL;
+        return req;
+    }
     req->length = content_length(req);
     if (req->length != 0) {
         if (req->length > MAX_REQUEST_BODY_LENGTH) {
@@ -113,13 +236,13 @@ static void upcase(char *str) {
     }
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in) {
+static int read_request_line(struct HTTPRequest *req, FILE *in) {
     char buf[LINE_BUF_SIZE];
     char *path, *p;
 
     // 一行読み込み「GET /path/to/file HTTP/1.0\0」のような文字列を受け取る
     if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        log_exit("no request line");
+        return 0;
     }
 
     // 1つ目の空白までポインタpを移動
@@ -160,6 +283,7 @@ static void read_request_line(struct HTTPRequest *req, FILE *in) {
     p += strlen("HTTP/1.");
     // HTTPのマイナーバージョンをセット
     req->protocol_minor_version = atoi(p);
+    return 1;
 }
 
 static struct HTTPHeaderField *read_header_field(FILE *in) {
@@ -185,6 +309,8 @@ static struct HTTPHeaderField *read_header_field(FILE *in) {
     strcpy(h->name, buf);
 
     p += strspn(p, " \t");
+    // 行末の改行と空白は値に含めない
+    p[strcspn(p, "\r\n")] = '\0';
     h->value = xmalloc(strlen(p) + 1);
     strcpy(h->value, p);
 
@@ -216,6 +342,32 @@ static long content_length(struct HTTPRequest *req) {
     return len;
 }
 
+// カンマ区切りのヘッダ値にtokenが含まれているかを大文字小文字を区別せずに調べる
+static int has_token(char *value, char *token) {
+    size_t len = strlen(token);
+    char *p = value;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (strncasecmp(p, token, len) == 0 && (p[len] == '\0' || strchr(" \t,", p[len]))) {
+            return 1;
+        }
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// HTTP/1.1は"Connection: close"がなければ、HTTP/1.0は"Connection: keep-alive"があれば続ける
+static int request_keep_alive(struct HTTPRequest *req) {
+    char *val;
+
+    val = lookup_header_field_value(req, "Connection");
+    if (req->protocol_minor_version >= 1) {
+        return !(val && has_token(val, "close"));
+    }
+    return val && has_token(val, "keep-alive");
+}
+
 static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot);
 
 static void method_not_allowed(struct HTTPRequest *req, FILE *out);
@@ -225,7 +377,9 @@ static void not_implemented(struct HTTPRequest *req, FILE *out);
 static void not_found(struct HTTPRequest *req, FILE *out);
 
 static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot) {
-    if (strcmp(req->method, "GET") == 0) {
+    if (lookup_header_field_value(req, "Transfer-Encoding")) {
+        not_implemented(req, out);
+    } else if (strcmp(req->method, "GET") == 0) {
         do_file_respond(req, out, docroot);
     } else if (strcmp(req->method, "HEAD") == 0) {
         do_file_respond(req, out, docroot);
@@ -252,10 +406,60 @@ static void output_common_header_fileds(struct HTTPRequest *req, FILE *out, char
     }
 
     strftime(buf, LINE_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", 0, status);
+    fprintf(out, "HTTP/1.%d %s\r\n", req->protocol_minor_version >= 1 ? 1 : 0, status);
     fprintf(out, "Date: %s\r\n", buf);
     fprintf(out, "Server: %s/%s\r\n", "super server", "2.3");
-    fprintf(out, "Connection: close\r\n");
+    fprintf(out, "Connection: %s\r\n", req->keep_alive ? "keep-alive" : "close");
+}
+
+static int is_socket(int fd) {
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+// ヘッダはstdioのバッファから先に送り、ボディはカーネル内でファイルからソケットへ直接送る
+static void send_file_body(struct FileInfo *info, int fd, FILE *out) {
+    off_t offset = 0;
+    ssize_t n;
+
+    fflush(out);
+    while (offset < info->size) {
+        n = sendfile(fileno(out), fd, &offset, info->size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_exit("failed to send %s: %s", info->path, strerror(errno));
+        }
+        // 送っている間にファイルが縮んだ。Content-Lengthに足りないので続けられない
+        if (n == 0) {
+            log_exit("%s was truncated while sending", info->path);
+        }
+    }
+}
+
+// パイプなどsendfile(2)で書けない出力には、読んだ分をstdioで書く
+static void copy_file_body(struct FileInfo *info, int fd, FILE *out) {
+    char buf[BLOCK_BUF_SIZE];
+    ssize_t n;
+    size_t len, result;
+
+    for (;;) {
+        n = read(fd, buf, BLOCK_BUF_SIZE);
+        if (n < 0) {
+            log_exit("failed to read %s: %s", info->path, strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+
+        len = (size_t) n;
+        result = fwrite(buf, 1, len, out);
+        if (result < len) {
+            log_exit("failed to write to socket: result=%zu, n=%zu", result, len);
+        }
+    }
 }
 
 static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot) {
@@ -276,30 +480,16 @@ static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot) {
 
     if (strcmp(req->method, "HEAD") != 0) {
         int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
-        size_t result;
 
         fd = open(info->path, O_RDONLY);
         if (fd < 0) {
             log_exit("failed to open %s: %s", info->path, strerror(errno));
         }
-
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0) {
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            }
-            if (n == 0) {
-                break;
-            }
-
-            result = fwrite(buf, 1, n, out);
-            if (result < n) {
-                log_exit("failed to write to socket: result=%d, n=%d", result, n);
-            }
+        if (is_socket(fileno(out))) {
+            send_file_body(info, fd, out);
+        } else {
+            copy_file_body(info, fd, out);
         }
-
         close(fd);
     }
     fflush(out);
@@ -308,6 +498,7 @@ static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot) {
 
 static void method_not_allowed(struct HTTPRequest *req, FILE *out) {
     output_common_header_fileds(req, out, "405 Method Not Allowed");
+    fprintf(out, "Content-Length: %zu\r\n", strlen("method_not_allowed\r\n"));
     fprintf(out, "Content-Type: %s\r\n", "text/plain");
     fprintf(out, "\r\n");
     fprintf(out, "method_not_allowed\r\n");
@@ -316,6 +507,7 @@ static void method_not_allowed(struct HTTPRequest *req, FILE *out) {
 
 static void not_implemented(struct HTTPRequest *req, FILE *out) {
     output_common_header_fileds(req, out, "501 Not Implemented");
+    fprintf(out, "Content-Length: %zu\r\n", strlen("not_implemented\r\n"));
     fprintf(out, "Content-Type: %s\r\n", "text/plain");
     fprintf(out, "\r\n");
     fprintf(out, "not_implemented\r\n");
@@ -324,6 +516,7 @@ static void not_implemented(struct HTTPRequest *req, FILE *out) {
 
 static void not_found(struct HTTPRequest *req, FILE *out) {
     output_common_header_fileds(req, out, "404 Not Found");
+    fprintf(out, "Content-Length: %zu\r\n", strlen("not_found\r\n"));
     fprintf(out, "Content-Type: %s\r\n", "text/plain");
     fprintf(out, "\r\n");
     fprintf(out, "not_found\r\n");
@@ -388,6 +581,17 @@ static void trap_signal(int sig, sighandler_t handler) {
     }
 }
 
+// 終わった子プロセスはwait(2)しなくても回収される
+static void detach_children(void) {
+    struct sigaction act;
+    act.sa_handler = SIG_DFL;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
+    if (sigaction(SIGCHLD, &act, NULL) < 0) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+}
+
 static void signal_exit(int sig) {
     log_exit("exit by signal %d", sig);
 }
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+
+// server2の--handlerで起動する動的ハンドラの見本。server2が作ったUnixドメインソケットを
+// fd 3で受け取り(LISTEN_FDS=1)、各接続から届くフレームに1つずつ応答する。
+//
+// フレームは32ビットのidと長さ(どちらもホストのバイト順)に続く本体で、
+// 要求の本体はHTTP/1.xのリクエストそのまま、応答の本体はCGIと同じくヘッダ・空行・ボディ。
+// 同じ接続に複数の要求が続けて届くので、応答にはそれぞれの要求のidを付けて返す。
+// ソケットは抽象名前空間にあって誰でも繋げるので、server2と同じユーザーからの接続だけを受け付ける
+
+#define LISTEN_FDS_START 3
+#define MAX_CLIENTS 64
+#define MAX_FRAME (16 * 1024 * 1024)
+#define BUF_SIZE 8192
+
+struct HandlerFrame {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct Client {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void log_exit(const char *fmt, ...);
+static void *xmalloc(size_t sz);
+static int write_all(int fd, const char *buf, size_t len);
+static int handle_frames(struct Client *c);
+static int respond(int fd, uint32_t id, char *req, size_t len);
+static int peer_allowed(int sock);
+
+int main(int argc, char *argv[]) {
+    struct pollfd fds[MAX_CLIENTS + 1];
+    struct Client clients[MAX_CLIENTS];
+    char *env;
+    int nclients = 0;
+    int i;
+
+    env = getenv("LISTEN_FDS");
+    if (!env || atoi(env) != 1) {
+        log_exit("%s must be started by server2 --handler", argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        fds[0].fd = nclients < MAX_CLIENTS ? LISTEN_FDS_START : -1;
+        fds[0].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, nclients + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_exit("poll(2) failed: %s", strerror(errno));
+        }
+        // 後ろから見れば、閉じた接続を末尾と入れ替えてもまだ見ていないものを飛ばさない
+        for (i = nclients - 1; i >= 0; i--) {
+            if (fds[i + 1].revents && handle_frames(&clients[i]) < 0) {
+                close(clients[i].fd);
+                free(clients[i].buf);
+                clients[i] = clients[--nclients];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int sock = accept4(LISTEN_FDS_START, NULL, NULL, SOCK_CLOEXEC);
+
+            if (sock < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    log_exit("accept4(2) failed: %s", strerror(errno));
+                }
+                continue;
+            }
+            if (!peer_allowed(sock)) {
+                close(sock);
+                continue;
+            }
+            clients[nclients].fd = sock;
+            clients[nclients].cap = BUF_SIZE;
+            clients[nclients].buf = xmalloc(BUF_SIZE);
+            clients[nclients].len = 0;
+            nclients++;
+        }
+    }
+}
+
+// server2はハンドラを起動する前に権限を落としているので、同じユーザーなら自分を起動したサーバのプロセス
+static int peer_allowed(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return 0;
+    }
+    if (cred.uid != geteuid()) {
+        fprintf(stderr, "rejected connection from uid %d (pid %d)\n", (int) cred.uid, (int) cred.pid);
+        return 0;
+    }
+    return 1;
+}
+
+// 届いた分を読み、揃ったフレームに応答する。接続を閉じるなら-1
+static int handle_frames(struct Client *c) {
+    struct HandlerFrame frame;
+    size_t pos = 0;
+    ssize_t n;
+
+    if (c->len == c->cap) {
+        c->cap *= 2;
+        c->buf = realloc(c->buf, c->cap);
+        if (!c->buf) {
+            log_exit("failed to allocate memory");
+        }
+    }
+    n = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (n < 0 && errno == EINTR) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    c->len += n;
+    while (c->len - pos >= sizeof frame) {
+        memcpy(&frame, c->buf + pos, sizeof frame);
+        if (frame.len > MAX_FRAME) {
+            return -1;
+        }
+        if (c->len - pos - sizeof frame < frame.len) {
+            break;
+        }
+        if (respond(c->fd, frame.id, c->buf + pos + sizeof frame, frame.len) < 0) {
+            return -1;
+        }
+        pos += sizeof frame + frame.len;
+    }
+    memmove(c->buf, c->buf + pos, c->len - pos);
+    c->len -= pos;
+    return 0;
+}
+
+// リクエスト行とボディの大きさ、応答したプロセスを返す
+static int respond(int fd, uint32_t id, char *req, size_t len) {
+    struct HandlerFrame frame;
+    char *header_end, *line_end;
+    char body[1024];
+    char *reply;
+    int n, body_len;
+
+    header_end = memmem(req, len, "\r\n\r\n", 4);
+    line_end = memmem(req, len, "\r\n", 2);
+    if (!header_end || !line_end) {
+        return -1;
+    }
+    body_len = snprintf(body, sizeof body, "pid: %d\nrequest: %.*s\nbody: %zu bytes\n",
+                        (int) getpid(), (int) (line_end - req), req, len - (header_end + 4 - req));
+    if (body_len >= (int) sizeof body) {
+        body_len = sizeof body - 1;
+    }
+    reply = xmalloc(sizeof frame + 128 + body_len);
+    n = sprintf(reply + sizeof frame, "Status: 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n");
+    memcpy(reply + sizeof frame + n, body, body_len);
+    frame.id = id;
+    frame.len = n + body_len;
+    memcpy(reply, &frame, sizeof frame);
+    n = write_all(fd, reply, sizeof frame + frame.len);
+    free(reply);
+    return n;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *xmalloc(size_t sz) {
+    void *p;
+
+    p = malloc(sz);
+    if (!p) {
+        log_exit("failed to allocate memory");
+    }
+    return p;
+}
+
+static void log_exit(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
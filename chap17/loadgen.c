@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <getopt.h>
+#include <pthread.h>
+
+// server2のベンチマーク用の負荷生成ツール。ループバックでN本の接続を張り、
+// 重み付きのリクエストの組み合わせを投げ続けてスループットとレイテンシの分布をJSONで出す
+
+#define USAGE "Usage: %s [--host=h] [--port=n] [--connections=n] [--threads=n] [--duration=sec]" \
+              " [--no-keepalive] [--mix=path:weight,...] [--seed=n]\n" \
+              "       %s --make-docroot=dir\n"
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "80"
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_THREADS 1
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "/1k.html:70,/16k.html:20,/256k.bin:8,/1m.bin:2"
+#define MAX_MIX 32
+#define MAX_EVENTS 256
+#define HEADER_BUF_SIZE 8192
+#define READ_BUF_SIZE (64 * 1024)
+#define REQUEST_BUF_SIZE 512
+#define RETRY_DELAY_US 10000  // 接続できなかったらこの間をおいて張り直す
+
+// HdrHistogram風の対数線形ヒストグラム。2のべき乗ごとに2^HIST_SUB_BITS個に分けるので誤差は約3%
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_COUNT)
+
+#define CONN_CONNECTING 0
+#define CONN_SENDING 1
+#define CONN_HEADERS 2
+#define CONN_BODY 3
+
+struct Histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long min;
+    unsigned long max;
+    unsigned long sum;
+};
+
+struct MixEntry {
+    char *path;
+    unsigned weight;
+    char request[REQUEST_BUF_SIZE];
+    size_t request_len;
+};
+
+struct Client {
+    int sock;
+    int state;
+    int reused;           // 前のレスポンスを受け取ったあとの接続を使い回している
+    int close_after;      // サーバーがConnection: closeを返した
+    struct MixEntry *entry;
+    size_t sent;
+    char header[HEADER_BUF_SIZE];
+    size_t header_len;
+    long body_remain;
+    int status;
+    long long started;    // 接続（キープアライブなら送信）を始めた時刻(us)
+    long long retry_at;   // 0でなければ、この時刻(us)に接続をやり直す
+};
+
+struct Worker {
+    pthread_t thread;
+    int index;
+    int nclients;
+    unsigned long long rand_state;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long bytes;
+    unsigned long connects;
+    unsigned long connect_errors;
+    int retrying;         // retry_atを待っているクライアントの数
+    unsigned long status[6];
+    struct Histogram hist;
+};
+
+static struct addrinfo *server_addr;
+static struct MixEntry mix[MAX_MIX];
+static int nmix = 0;
+static unsigned mix_total = 0;
+static int keepalive = 1;
+static long long deadline;
+
+static struct option longopts[] = {
+        {"host",          required_argument, NULL, 'H'},
+        {"port",          required_argument, NULL, 'p'},
+        {"connections",   required_argument, NULL, 'c'},
+        {"threads",       required_argument, NULL, 't'},
+        {"duration",      required_argument, NULL, 'd'},
+        {"no-keepalive",  no_argument,       NULL, 'n'},
+        {"mix",           required_argument, NULL, 'm'},
+        {"seed",          required_argument, NULL, 's'},
+        {"make-docroot",  required_argument, NULL, 'D'},
+        {"help",          no_argument,       NULL, 'h'},
+        {0,               0,                 0,    0}
+};
+
+static void die(const char *fmt, ...);
+
+static void make_docroot(const char *dir);
+
+static void parse_mix(char *spec, const char *host);
+
+static void *worker_main(void *arg);
+
+static void report(struct Worker *workers, int nworkers, int connections, double elapsed);
+
+static long long now_us(void);
+
+int main(int argc, char *argv[]) {
+    struct addrinfo hints;
+    struct Worker *workers;
+    char *host = DEFAULT_HOST;
+    char *port = DEFAULT_PORT;
+    char *mixspec = DEFAULT_MIX;
+    int connections = DEFAULT_CONNECTIONS;
+    int nthreads = DEFAULT_THREADS;
+    int duration = DEFAULT_DURATION;
+    unsigned long long seed = 1;
+    long long start;
+    int opt, err, i;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                keepalive = 0;
+                break;
+            case 'm':
+                mixspec = optarg;
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                make_docroot(optarg);
+                exit(0);
+            case 'h':
+                fprintf(stdout, USAGE, argv[0], argv[0]);
+                exit(0);
+            case '?':
+                fprintf(stderr, USAGE, argv[0], argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc || connections < 1 || nthreads < 1 || duration < 1) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        exit(1);
+    }
+    if (nthreads > connections) {
+        nthreads = connections;
+    }
+    parse_mix(mixspec, host);
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &server_addr)) != 0) {
+        die("getaddrinfo(3): %s", gai_strerror(err));
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = calloc(nthreads, sizeof(struct Worker));
+    if (!workers) {
+        die("failed to allocate memory");
+    }
+    start = now_us();
+    deadline = start + duration * 1000000LL;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].index = i;
+        // 接続を均等に分け、乱数はシードとスレッド番号から決めて毎回同じ組み合わせを投げる
+        workers[i].nclients = connections / nthreads + (i < connections % nthreads);
+        workers[i].rand_state = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+        workers[i].hist.min = (unsigned long) -1;
+        if ((err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) != 0) {
+            die("pthread_create: %s", strerror(err));
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    report(workers, nthreads, connections, (now_us() - start) / 1e6);
+    freeaddrinfo(server_addr);
+    exit(0);
+}
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// 既定の組み合わせで使うファイルを作る。中身は毎回同じ
+static void make_docroot(const char *dir) {
+    static const struct {
+        const char *name;
+        long size;
+    } files[] = {{"1k.html", 1024}, {"16k.html", 16 * 1024}, {"256k.bin", 256 * 1024}, {"1m.bin", 1024 * 1024}};
+    char path[4096];
+    char buf[4096];
+    long left;
+    size_t i, n;
+    FILE *f;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        die("mkdir %s: %s", dir, strerror(errno));
+    }
+    for (i = 0; i < sizeof buf; i++) {
+        buf[i] = "abcdefghijklmnopqrstuvwxyz0123456789\n"[i % 37];
+    }
+    for (i = 0; i < sizeof files / sizeof files[0]; i++) {
+        snprintf(path, sizeof path, "%s/%s", dir, files[i].name);
+        f = fopen(path, "w");
+        if (!f) {
+            die("%s: %s", path, strerror(errno));
+        }
+        for (left = files[i].size; left > 0; left -= n) {
+            n = left < (long) sizeof buf ? (size_t) left : sizeof buf;
+            if (fwrite(buf, 1, n, f) != n) {
+                die("%s: %s", path, strerror(errno));
+            }
+        }
+        if (fclose(f) != 0) {
+            die("%s: %s", path, strerror(errno));
+        }
+    }
+}
+
+// "path:weight,path:weight"を読み、送るリクエストを組み立てておく。weightを省略すると1
+static void parse_mix(char *spec, const char *host) {
+    char *copy, *item, *save, *colon;
+    int n;
+
+    copy = strdup(spec);
+    for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (nmix == MAX_MIX) {
+            die("too many paths in --mix");
+        }
+        colon = strrchr(item, ':');
+        mix[nmix].weight = 1;
+        if (colon) {
+            *colon = '\0';
+            mix[nmix].weight = (unsigned) atoi(colon + 1);
+        }
+        if (item[0] != '/' || mix[nmix].weight == 0) {
+            die("invalid --mix entry: %s", item);
+        }
+        mix[nmix].path = strdup(item);
+        n = snprintf(mix[nmix].request, REQUEST_BUF_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", item, host,
+                     keepalive ? "" : "Connection: close\r\n");
+        if (n >= REQUEST_BUF_SIZE) {
+            die("path too long: %s", item);
+        }
+        mix[nmix].request_len = (size_t) n;
+        mix_total += mix[nmix].weight;
+        nmix++;
+    }
+    free(copy);
+    if (nmix == 0) {
+        die("empty --mix");
+    }
+}
+
+static int hist_index(unsigned long v) {
+    int shift;
+
+    if (v < 2 * HIST_SUB_COUNT) {
+        return (int) v;
+    }
+    shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + (int) (v >> shift);
+}
+
+// バケットに入る最小の値
+static unsigned long hist_value(int index) {
+    int shift;
+
+    if (index < 2 * HIST_SUB_COUNT) {
+        return (unsigned long) index;
+    }
+    shift = index / HIST_SUB_COUNT - 1;
+    return (unsigned long) (index - shift * HIST_SUB_COUNT) << shift;
+}
+
+static void hist_record(struct Histogram *h, unsigned long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void hist_merge(struct Histogram *to, struct Histogram *from) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->min < to->min) {
+        to->min = from->min;
+    }
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+}
+
+// q番目の値が入っているバケットの上端。最大値を超えないように丸める
+static unsigned long hist_percentile(struct Histogram *h, double q) {
+    unsigned long rank, seen = 0, v;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    rank = (unsigned long) (q * h->total);
+    if (rank >= h->total) {
+        rank = h->total - 1;
+    }
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            v = hist_value(i + 1) - 1;
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// xorshift64*。スレッドごとに持つのでロックは要らない
+static unsigned long long next_random(struct Worker *w) {
+    w->rand_state ^= w->rand_state >> 12;
+    w->rand_state ^= w->rand_state << 25;
+    w->rand_state ^= w->rand_state >> 27;
+    return w->rand_state * 2685821657736338717ULL;
+}
+
+static struct MixEntry *pick_entry(struct Worker *w) {
+    unsigned r = (unsigned) (next_random(w) % mix_total);
+    int i;
+
+    for (i = 0; i < nmix - 1; i++) {
+        if (r < mix[i].weight) {
+            break;
+        }
+        r -= mix[i].weight;
+    }
+    return &mix[i];
+}
+
+static int start_connect(int epfd, struct Client *c);
+
+static void start_request(int epfd, struct Worker *w, struct Client *c);
+
+static void handle_client(int epfd, struct Worker *w, struct Client *c, char *buf);
+
+static void retry_clients(int epfd, struct Worker *w, struct Client *clients);
+
+// スレッドごとに1つのepollで担当の接続をすべて回す。期限を過ぎたら送信中のものは数えずに終わる
+static void *worker_main(void *arg) {
+    struct Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct Client *clients;
+    char *buf;
+    int epfd, n, i;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    clients = calloc(w->nclients, sizeof(struct Client));
+    buf = malloc(READ_BUF_SIZE);
+    if (epfd < 0 || !clients || !buf) {
+        die("failed to set up worker %d", w->index);
+    }
+    for (i = 0; i < w->nclients; i++) {
+        clients[i].sock = -1;
+        start_request(epfd, w, &clients[i]);
+    }
+    while (now_us() < deadline) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, w->retrying ? RETRY_DELAY_US / 1000 : 100);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait(2): %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            handle_client(epfd, w, events[i].data.ptr, buf);
+        }
+        if (w->retrying) {
+            retry_clients(epfd, w, clients);
+        }
+    }
+    for (i = 0; i < w->nclients; i++) {
+        if (clients[i].sock >= 0) {
+            close(clients[i].sock);
+        }
+    }
+    close(epfd);
+    free(clients);
+    free(buf);
+    return NULL;
+}
+
+static int start_connect(int epfd, struct Client *c) {
+    struct epoll_event ev;
+    int one = 1;
+
+    c->sock = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->sock < 0) {
+        die("socket(2): %s", strerror(errno));
+    }
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (connect(c->sock, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+        die("epoll_ctl(2): %s", strerror(errno));
+    }
+    c->state = CONN_CONNECTING;
+    c->reused = 0;
+    return 0;
+}
+
+static void close_client(struct Client *c) {
+    if (c->sock >= 0) {
+        close(c->sock);
+        c->sock = -1;
+    }
+}
+
+static void retry_later(struct Worker *w, struct Client *c);
+
+// 次に送るパスを選び、接続がなければ張り直してから送る
+static void start_request(int epfd, struct Worker *w, struct Client *c) {
+    struct epoll_event ev;
+
+    c->entry = pick_entry(w);
+    c->sent = 0;
+    c->header_len = 0;
+    c->close_after = 0;
+    c->started = now_us();
+    if (c->sock < 0) {
+        w->connects++;
+        if (start_connect(epfd, c) < 0) {
+            retry_later(w, c);
+        }
+        return;
+    }
+    c->state = CONN_SENDING;
+    c->reused = 1;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+// 接続できなかったクライアントは、時間をおいてretry_clients()から張り直す。
+// サーバーがまだlistenしていない間に、すぐ失敗する接続を繰り返さないようにする
+static void retry_later(struct Worker *w, struct Client *c) {
+    close_client(c);
+    w->errors++;
+    w->connect_errors++;
+    c->retry_at = now_us() + RETRY_DELAY_US;
+    w->retrying++;
+}
+
+static void retry_clients(int epfd, struct Worker *w, struct Client *clients) {
+    long long now = now_us();
+    int i;
+
+    for (i = 0; i < w->nclients; i++) {
+        if (clients[i].retry_at && clients[i].retry_at <= now) {
+            clients[i].retry_at = 0;
+            w->retrying--;
+            start_request(epfd, w, &clients[i]);
+        }
+    }
+}
+
+// 失敗したリクエストを数えて、新しい接続でやり直す
+static void fail_request(int epfd, struct Worker *w, struct Client *c) {
+    // キープアライブ中にサーバーが先に閉じていただけなら、エラーにせず張り直す
+    if (!(c->reused && c->sent == c->entry->request_len && c->header_len == 0)) {
+        w->errors++;
+    }
+    close_client(c);
+    start_request(epfd, w, c);
+}
+
+static void finish_request(int epfd, struct Worker *w, struct Client *c) {
+    int class = c->status / 100;
+
+    hist_record(&w->hist, (unsigned long) (now_us() - c->started));
+    w->requests++;
+    w->status[class >= 1 && class <= 5 ? class : 0]++;
+    if (!keepalive || c->close_after) {
+        close_client(c);
+    }
+    start_request(epfd, w, c);
+}
+
+// ヘッダを最後まで受け取ったら、ステータスとContent-Lengthを読む。不正なら-1
+static int parse_headers(struct Client *c, char *end) {
+    char *line, *next;
+    int have_length = 0;
+
+    *end = '\0';
+    if (strncmp(c->header, "HTTP/1.", 7) != 0 || c->header_len < 12) {
+        return -1;
+    }
+    c->status = atoi(c->header + 9);
+    c->body_remain = 0;
+    for (line = strstr(c->header, "\r\n"); line; line = next) {
+        line += 2;
+        next = strstr(line, "\r\n");
+        // 行ごとに区切り、後ろの行の値まで見ないようにする
+        if (next) {
+            *next = '\0';
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_remain = atol(line + 15);
+            have_length = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close")) {
+            c->close_after = 1;
+        }
+    }
+    return c->status == 204 || c->status == 304 || have_length ? 0 : -1;
+}
+
+// バッファに読めた分をヘッダとボディに振り分ける。レスポンスが完了したら1
+static int consume_response(struct Worker *w, struct Client *c, char *buf, size_t n) {
+    char *end;
+    size_t take, body;
+
+    w->bytes += n;
+    if (c->state == CONN_HEADERS) {
+        take = n < HEADER_BUF_SIZE - 1 - c->header_len ? n : HEADER_BUF_SIZE - 1 - c->header_len;
+        memcpy(c->header + c->header_len, buf, take);
+        c->header_len += take;
+        c->header[c->header_len] = '\0';
+        end = strstr(c->header, "\r\n\r\n");
+        if (!end) {
+            return c->header_len == HEADER_BUF_SIZE - 1 ? -1 : 0;
+        }
+        // ヘッダの後ろに続いて届いた分はボディ
+        body = n - ((size_t) (end + 4 - c->header) - (c->header_len - take));
+        c->header_len = (size_t) (end + 4 - c->header);
+        if (parse_headers(c, end) < 0) {
+            return -1;
+        }
+        c->state = CONN_BODY;
+        n = body;
+    }
+    if ((long) n > c->body_remain) {
+        return -1;  // パイプライン化していないので余分なバイトは来ないはず
+    }
+    c->body_remain -= (long) n;
+    return c->body_remain == 0;
+}
+
+static void handle_client(int epfd, struct Worker *w, struct Client *c, char *buf) {
+    struct epoll_event ev;
+    socklen_t len;
+    ssize_t n;
+    int err, done;
+
+    if (c->state == CONN_CONNECTING) {
+        len = sizeof err;
+        if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            retry_later(w, c);
+            return;
+        }
+        c->state = CONN_SENDING;
+    }
+    if (c->state == CONN_SENDING) {
+        while (c->sent < c->entry->request_len) {
+            n = send(c->sock, c->entry->request + c->sent, c->entry->request_len - c->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return;
+                }
+                fail_request(epfd, w, c);
+                return;
+            }
+            c->sent += (size_t) n;
+        }
+        c->state = CONN_HEADERS;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        return;
+    }
+    for (;;) {
+        n = recv(c->sock, buf, READ_BUF_SIZE, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            fail_request(epfd, w, c);
+            return;
+        }
+        if (n == 0) {
+            fail_request(epfd, w, c);
+            return;
+        }
+        done = consume_response(w, c, buf, (size_t) n);
+        if (done < 0) {
+            w->errors++;
+            close_client(c);
+            start_request(epfd, w, c);
+            return;
+        }
+        if (done) {
+            finish_request(epfd, w, c);
+            return;
+        }
+    }
+}
+
+// 全スレッドの結果をまとめてJSONで標準出力に書く。レイテンシの単位はマイクロ秒
+static void report(struct Worker *workers, int nworkers, int connections, double elapsed) {
+    static struct Histogram hist;
+    static const double percentiles[] = {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999};
+    static const char *percentile_names[] = {"p50", "p75", "p90", "p99", "p999", "p9999"};
+    unsigned long requests = 0, errors = 0, bytes = 0, connects = 0, connect_errors = 0, status[6] = {0};
+    int i, j, first;
+
+    hist.min = (unsigned long) -1;
+    for (i = 0; i < nworkers; i++) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        connects += workers[i].connects;
+        connect_errors += workers[i].connect_errors;
+        for (j = 0; j < 6; j++) {
+            status[j] += workers[i].status[j];
+        }
+        hist_merge(&hist, &workers[i].hist);
+    }
+    if (hist.total == 0) {
+        hist.min = 0;
+    }
+
+    printf("{\n");
+    printf("  \"connections\": %d,\n", connections);
+    printf("  \"threads\": %d,\n", nworkers);
+    printf("  \"keepalive\": %s,\n", keepalive ? "true" : "false");
+    printf("  \"mix\": [");
+    for (i = 0; i < nmix; i++) {
+        printf("%s{\"path\": \"%s\", \"weight\": %u}", i ? ", " : "", mix[i].path, mix[i].weight);
+    }
+    printf("],\n");
+    printf("  \"duration_sec\": %.3f,\n", elapsed);
+    printf("  \"requests\": %lu,\n", requests);
+    printf("  \"errors\": %lu,\n", errors);
+    printf("  \"connects\": %lu,\n", connects);
+    printf("  \"connect_errors\": %lu,\n", connect_errors);
+    printf("  \"bytes_received\": %lu,\n", bytes);
+    printf("  \"requests_per_sec\": %.1f,\n", requests / elapsed);
+    printf("  \"mbytes_per_sec\": %.2f,\n", bytes / elapsed / (1024 * 1024));
+    printf("  \"status\": {\"1xx\": %lu, \"2xx\": %lu, \"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu, \"other\": %lu},\n",
+           status[1], status[2], status[3], status[4], status[5], status[0]);
+    printf("  \"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"max\": %lu", hist.min,
+           hist.total ? (double) hist.sum / hist.total : 0.0, hist.max);
+    for (i = 0; i < (int) (sizeof percentiles / sizeof percentiles[0]); i++) {
+        printf(", \"%s\": %lu", percentile_names[i], hist_percentile(&hist, percentiles[i]));
+    }
+    printf("},\n");
+    // 空でないバケットだけを[バケットの下端(us), 件数]で並べる
+    printf("  \"histogram\": [");
+    for (i = 0, first = 1; i < HIST_BUCKETS; i++) {
+        if (hist.counts[i] == 0) {
+            continue;
+        }
+        printf("%s[%lu, %lu]", first ? "" : ", ", hist_value(i), hist.counts[i]);
+        first = 0;
+    }
+    printf("]\n");
+    printf("}\n");
+}
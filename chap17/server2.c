@@ -1,60 +1,680 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <time.h>
 #include <syslog.h>
 #include <pwd.h>
 #include <grp.h>
-
-#define _GNU_SOURCE
-
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <limits.h>
+#include <zlib.h>
+
+// io_uringエンジンはカーネルヘッダが5.7以降の場合だけ組み込む。liburingは使わずシステムコールを直接呼ぶ
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef IORING_FEAT_FAST_POLL
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] <docroot>\n"
+#define USAGE "Usage: %s [--port=n] [--engine=fork|epoll|io_uring] [--workers=n [--cpu-affinity]] [--backlog=n]" \
+              " [--defer-accept=sec] [--fastopen=qlen] [--header-timeout=sec] [--body-timeout=sec] [--keepalive-timeout=sec] [--file-cache=entries] [--hot-cache=bytes] [--gzip-cache=bytes]" \
+              " [--io-threads=n] [--stats-path=path] [--access-log=file] [--uploads] [--autoindex] [--mime-types=file]" \
+              " [--handler=prefix=command [--handler-procs=n]]" \
+              " [--chroot --user=u --group=g] <docroot>\n"
 #define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
+#define MAX_REQUEST_HEADER_LENGTH (64 * 1024)
 #define LINE_BUF_SIZE 4096
-#define BLOCK_BUF_SIZE (4 * 1024 * 1024)
-#define MAX_BACKLOG 5
+#define INPUT_BUF_SIZE 4096
+#define SEND_BUF_SIZE (64 * 1024)
+#define OUTPUT_BUF_SIZE 1024
+#define HTTP_DATE_SIZE 64
+#define ETAG_SIZE 64
+#define MAX_RANGES 16
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN sizeof(void *)
+#define DEFAULT_BACKLOG 511
+#define ACCEPT_BATCH 64  // 1回の通知で受け付ける接続の上限。残りは次の通知で受け付ける
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_HEADER_TIMEOUT 10  // 最初のバイトからヘッダを受け取り終えるまで
+#define DEFAULT_BODY_TIMEOUT 30    // ボディを受け取っている間、何も届かずに待てる秒数
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3  // 1秒刻みで64^3秒先までの満了時刻を扱える
+#define DEFAULT_FILE_CACHE_SIZE 1024
+#define INOTIFY_BUF_SIZE 4096
+#define DEFAULT_HOT_CACHE_BYTES (16 * 1024 * 1024)
+#define HOT_CACHE_MAX_FILE (64 * 1024)
+#define DEFAULT_GZIP_CACHE_BYTES (16 * 1024 * 1024)
+#define GZIP_MIN_FILE 256
+#define GZIP_MAX_FILE (1024 * 1024)
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+#define SKETCH_RESET_INTERVAL (10 * SKETCH_WIDTH)
+#define MAX_EVENTS 64
+#define DEFAULT_IO_THREADS 4
+#define TASK_QUEUE_SIZE 64
+#define TASK_READAHEAD (1024 * 1024)
+#define URING_ENTRIES 256
+#define URING_ZC_MIN (16 * 1024)
+#define HIST_BUCKETS 128
+#define LISTEN_COUNTERS 4
+#define ACCESS_LOG_SLOTS 4096  // 2のべき乗
+#define ACCESS_LOG_LINE_SIZE 512
+#define ACCESS_LOG_BATCH (64 * 1024)
+#define ACCESS_LOG_FLUSH_MS 100
+#define RATE_WINDOW 10
+#define UPGRADE_TIMEOUT 10  // 後継プロセスの準備ができるまで待つ秒数
+#define DRAIN_TIMEOUT 30    // 受け付けをやめてから処理中の接続を待つ秒数
+#define LISTEN_FDS_START 3  // systemdと同じく、引き継ぐリスニングソケットは3番から並べる
+#define READY_FD_ENV "SERVER2_READY_FD"
 #define DEFAULT_PORT "80"
+#define DEFAULT_HANDLER_PROCS 4
+#define HANDLER_BACKLOG 128
+#define MAX_HANDLER_REPLY (16 * 1024 * 1024)
+#define HANDLER_RESTART_DELAY 1  // 起動してすぐに落ちたハンドラは、この秒数待ってから起動し直す
+#define HANDLER_TIMEOUT 30       // ハンドラの応答を待つ秒数。過ぎたら502を返す
+#define HANDLER_BACKOFF_US 1000000LL  // 接続が切れたハンドラは、この間は他のハンドラに渡せるなら使わない
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+#define MAX_EXTENSION 16
+#define INDEX_FILE "index.html"  // "/"で終わるパスに返すファイル
+#define LISTING_CACHE_SIZE 64
+#define LISTING_FLUSH (32 * 1024)  // 描画中の一覧はこの大きさごとにmemfdへ書き出す
+
+#define ENGINE_FORK 0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+
+#define REQ_OK 1
+#define REQ_INCOMPLETE 0
+#define REQ_BAD (-1)
+#define REQ_PENDING 2  // io_uringでファイルを調べ終わるのを待っている
+#define REQ_UPLOADING 3  // アップロードのボディを受け取ってファイルに書いている
+#define REQ_UNSUPPORTED (-2)  // ボディの区切りが分からないので501を返して接続を閉じる
+
+#define TIMEOUT_NONE 0
+#define TIMEOUT_HEADER 1
+#define TIMEOUT_BODY 2
+#define TIMEOUT_KEEPALIVE 3
+#define TIMEOUT_HANDLER 4
+#define TIMEOUT_KINDS 5
+
+#define CONN_READING 0
+#define CONN_WRITING 1
+#define CONN_UPLOADING 2
+
+#define SOURCE_LISTENER 0
+#define SOURCE_CONNECTION 1
+#define SOURCE_INOTIFY 2
+#define SOURCE_TIMER 3
+#define SOURCE_ZC_SEND 4
+#define SOURCE_POOL 5
+#define SOURCE_CANCEL 6
+#define SOURCE_HANDLER 7      // ハンドラへの接続。io_uringでは読めるようになるのを待つPOLL_ADD
+#define SOURCE_HANDLER_OUT 8  // io_uringで、ハンドラへの接続に書けるようになるのを待つPOLL_ADD
+
+// io_uringで接続ごとに実行中の操作。1つの接続で同時に投入するのは1つだけ
+#define UOP_NONE 0
+#define UOP_RECV 1
+#define UOP_SENDMSG 2
+#define UOP_SEND_ZC 3
+#define UOP_STATX 4
+#define UOP_OPENAT 5
+#define UOP_SPLICE_IN 6
+#define UOP_SPLICE_OUT 7
+#define UOP_UPLOAD_RECV 8
+#define UOP_UPLOAD_WRITE 9
+
+#define BODY_SENDFILE 0
+#define BODY_SPLICE 1
+#define BODY_COPY 2
+
+// 送れるContent-Encoding。ENC_IDENTITYは符号化なし
+#define ENC_IDENTITY 0
+#define ENC_GZIP 1
+#define ENC_BR 2
+#define ENC_COUNT 3
+
+// レイテンシを計る処理の段階。STAGE_TOTALは最初のバイトを受け取ってから送り終えるまで
+#define STAGE_READ 0
+#define STAGE_LOOKUP 1
+#define STAGE_RESPOND 2
+#define STAGE_SEND 3
+#define STAGE_TOTAL 4
+#define STAGE_COUNT 5
+
+#define WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+// よく使うヘッダ名の完全ハッシュ。名前の長さと小文字化した先頭・末尾の文字だけで衝突しないよう係数を選んである
+#define HEADER_HASH_SIZE 32
+#define HEADER_HASH(len, first, last) ((2 * (len) + 5 * ((first) | 0x20) + 7 * ((last) | 0x20)) & (HEADER_HASH_SIZE - 1))
+#define OTHER_HEADER_BUCKETS 16
+
+enum HeaderId {
+    HDR_UNKNOWN = 0,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_AUTHORIZATION,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_COOKIE,
+    HDR_EXPECT,
+    HDR_HOST,
+    HDR_IF_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_RANGE,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_KEEP_ALIVE,
+    HDR_RANGE,
+    HDR_REFERER,
+    HDR_TRANSFER_ENCODING,
+    HDR_USER_AGENT,
+    HDR_COUNT
+};
 
 typedef void (*sighandler_t)(int);
 
 static void log_exit(char *fmt, ...);
 
+static void log_error(char *fmt, ...);
+
+static void log_info(char *fmt, ...);
+
 static void *xmalloc(size_t sz);
 
+// リクエスト1つ分の確保をまとめて持ち、arena_reset()で一度に解放する
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaChunk *head;
+};
+
+// name/valueは受信バッファ内をヌル終端して直接指す（コピーしない）
 struct HTTPHeaderField {
     char *name;
+    size_t name_len;
     char *value;
+    size_t value_len;
     struct HTTPHeaderField *next;
+    struct HTTPHeaderField *bucket_next;  // other[]の同じバケットに入っている次のヘッダ
 };
 
 struct HTTPRequest {
     int protocol_minor_version;
+    int keep_alive;
     char *method;
     char *path;
-    struct HTTPHeaderField *header;
+    struct HTTPHeaderField *header;  // 届いた順のすべてのヘッダ
+    struct HTTPHeaderField *known[HDR_COUNT];  // よく使うヘッダは解析時にここへ索引を張る
+    struct HTTPHeaderField *other[OTHER_HEADER_BUCKETS];  // それ以外のヘッダのハッシュ表
     char *body;
     long length;
+    int streamed;        // ボディはinbufに溜めず、受け取りながらファイルに書く
+    struct Arena *arena;
+};
+
+struct KnownHeader {
+    char *name;
+    size_t len;
+};
+
+#define KNOWN_HEADER(name) {name, sizeof(name) - 1}
+
+static const struct KnownHeader known_headers[HDR_COUNT] = {
+        [HDR_UNKNOWN]             = {NULL, 0},
+        [HDR_ACCEPT]              = KNOWN_HEADER("accept"),
+        [HDR_ACCEPT_ENCODING]     = KNOWN_HEADER("accept-encoding"),
+        [HDR_AUTHORIZATION]       = KNOWN_HEADER("authorization"),
+        [HDR_CONNECTION]          = KNOWN_HEADER("connection"),
+        [HDR_CONTENT_LENGTH]      = KNOWN_HEADER("content-length"),
+        [HDR_CONTENT_TYPE]        = KNOWN_HEADER("content-type"),
+        [HDR_COOKIE]              = KNOWN_HEADER("cookie"),
+        [HDR_EXPECT]              = KNOWN_HEADER("expect"),
+        [HDR_HOST]                = KNOWN_HEADER("host"),
+        [HDR_IF_MATCH]            = KNOWN_HEADER("if-match"),
+        [HDR_IF_MODIFIED_SINCE]   = KNOWN_HEADER("if-modified-since"),
+        [HDR_IF_NONE_MATCH]       = KNOWN_HEADER("if-none-match"),
+        [HDR_IF_RANGE]            = KNOWN_HEADER("if-range"),
+        [HDR_IF_UNMODIFIED_SINCE] = KNOWN_HEADER("if-unmodified-since"),
+        [HDR_KEEP_ALIVE]          = KNOWN_HEADER("keep-alive"),
+        [HDR_RANGE]               = KNOWN_HEADER("range"),
+        [HDR_REFERER]             = KNOWN_HEADER("referer"),
+        [HDR_TRANSFER_ENCODING]   = KNOWN_HEADER("transfer-encoding"),
+        [HDR_USER_AGENT]          = KNOWN_HEADER("user-agent"),
+};
+
+// ハッシュ値からHeaderIdを引く表。空きはHDR_UNKNOWN
+static const unsigned char header_hash_table[HEADER_HASH_SIZE] = {
+        [HEADER_HASH(6, 'a', 't')]  = HDR_ACCEPT,
+        [HEADER_HASH(15, 'a', 'g')] = HDR_ACCEPT_ENCODING,
+        [HEADER_HASH(13, 'a', 'n')] = HDR_AUTHORIZATION,
+        [HEADER_HASH(10, 'c', 'n')] = HDR_CONNECTION,
+        [HEADER_HASH(14, 'c', 'h')] = HDR_CONTENT_LENGTH,
+        [HEADER_HASH(12, 'c', 'e')] = HDR_CONTENT_TYPE,
+        [HEADER_HASH(6, 'c', 'e')]  = HDR_COOKIE,
+        [HEADER_HASH(6, 'e', 't')]  = HDR_EXPECT,
+        [HEADER_HASH(4, 'h', 't')]  = HDR_HOST,
+        [HEADER_HASH(8, 'i', 'h')]  = HDR_IF_MATCH,
+        [HEADER_HASH(17, 'i', 'e')] = HDR_IF_MODIFIED_SINCE,
+        [HEADER_HASH(13, 'i', 'h')] = HDR_IF_NONE_MATCH,
+        [HEADER_HASH(8, 'i', 'e')]  = HDR_IF_RANGE,
+        [HEADER_HASH(19, 'i', 'e')] = HDR_IF_UNMODIFIED_SINCE,
+        [HEADER_HASH(10, 'k', 'e')] = HDR_KEEP_ALIVE,
+        [HEADER_HASH(5, 'r', 'e')]  = HDR_RANGE,
+        [HEADER_HASH(7, 'r', 'r')]  = HDR_REFERER,
+        [HEADER_HASH(17, 't', 'g')] = HDR_TRANSFER_ENCODING,
+        [HEADER_HASH(10, 'u', 't')] = HDR_USER_AGENT,
+};
+
+// メモリに置いたボディと、組み立て済みのヘッダ。送信中の接続とも共有するので参照カウントで管理する
+struct HotContent {
+    int refcount;
+    struct HotContent **owner;  // キャッシュに載っている間、これを指しているFileInfoのメンバ
+    unsigned int hash;          // 頻度の見積もりに使うパスのハッシュ
+    struct HotContent *lru_prev;
+    struct HotContent *lru_next;
+    char *headers;       // Content-Length以降、空行までのヘッダ
+    size_t header_len;
+    size_t len;
+    char data[];
 };
 
+// ファイルキャッシュと送信中のレスポンスで共有するので参照カウントで管理する
 struct FileInfo {
     char *path;
     long size;
+    time_t mtime;
+    const char *content_type;              // 拡張子から決めたもの。組み込みの表か--mime-typesで読んだ文字列を指す
+    char etag[ETAG_SIZE];                  // inode・サイズ・更新時刻(ns)から作る強い検証子
+    char last_modified[HTTP_DATE_SIZE];
     int ok;
+    int is_dir;          // 通常のファイルではなくディレクトリだった
+    int fd;              // 開いたままのファイル。まだ開いていなければ-1
+    int refcount;
+    int cached;          // ファイルキャッシュに入っている
+    struct HotContent *content;  // ホットキャッシュに載っていればその中身
+    struct HotContent *gzip;     // 圧縮キャッシュに載っていればgzipした中身
+    int gzip_useless;            // 圧縮しても小さくならなかった
+    int variants_checked;        // 圧縮済みの兄弟ファイルを探し終えた符号化のビット
+    struct FileInfo *variants[ENC_COUNT];  // foo.gzやfoo.brがあればそのFileInfo
+};
+
+// レスポンスヘッダ（と短いボディ）を組み立てるバッファ。接続ごとに確保して使い回す
+struct OutputBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct MimeType {
+    const char *ext;   // 小文字の拡張子。"."は含まない
+    const char *type;
+    size_t order;      // --mime-typesで読んだ順。同じ拡張子なら後のものを使う
+};
+
+// 描画済みのディレクトリ一覧。ディレクトリの更新時刻が変わるまで使い回す
+struct Listing {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec rendered;  // 描画を始めた時刻
+    struct FileInfo *info;     // 描画した一覧を書いたmemfd
+};
+
+struct ByteRange {
+    off_t first;
+    off_t last;
+};
+
+// multipart/byteranges のボディの一片。パートヘッダ（partsバッファ内）かファイルの範囲
+struct BodySegment {
+    int in_memory;
+    off_t offset;
+    off_t length;
+};
+
+// epollに登録するオブジェクトは先頭にこれを持ち、data.ptrから種類を判別する
+struct EventSource {
+    int type;
+};
+
+// タイマーホイールのスロットにつながる双方向リストの要素。挿入も取り消しもO(1)
+struct Timer {
+    struct Timer *prev;
+    struct Timer *next;
+    unsigned long expires;  // 満了する時刻（単調増加の秒）
+    int kind;               // TIMEOUT_*。止まっていればTIMEOUT_NONE
+};
+
+// 階層化したタイマーホイール。下の段は1秒刻み、上の段は1つ下の段の一周分を1スロットで受け持ち、
+// 下の段が一周するたびに次のスロットの分を下ろしてくる
+struct TimerWheel {
+    unsigned long now;   // 次に処理する時刻
+    long count;          // 動いているタイマーの数
+    struct Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];  // 各スロットの循環リストの番兵
+};
+
+// 1本のTCP接続の状態。forkモードでもepollモードでも同じ構造体でリクエストを処理する
+struct Connection {
+    struct EventSource source;
+    int sock;
+    int state;
+    int events;          // epollに登録中のイベント
+    int eof;             // クライアントが送信側を閉じた
+    int keep_alive;      // 今のレスポンスを送り終えたら次のリクエストを待つ
+    long served;
+    struct Timer timer;  // ヘッダ・ボディ・キープアライブのどれかを待っている間のタイムアウト
+    char *inbuf;         // 受信済みでまだ消費していないバイト列
+    size_t inlen;
+    size_t incap;
+    size_t scan_pos;     // ヘッダ終端の探索を再開する位置
+    size_t header_len;
+    struct HTTPRequest *req;  // ヘッダを解析済みでボディの到着を待っているリクエスト
+    struct Arena arena;
+    struct OutputBuffer out;  // レスポンスヘッダの書き込み先
+    size_t outpos;
+    int body_fd;         // レスポンスボディとして送るファイル
+    struct FileInfo *body_info;  // body_fdの持ち主
+    struct HotContent *body_content;  // メモリ上のボディ。body_offset/body_remainはこの中の位置を表す
+    struct BodySegment *segments;  // 複数範囲のレスポンスでは順にこれを送る
+    int nsegments;
+    int segment_index;
+    struct OutputBuffer parts;  // multipart/byteranges のパートヘッダ
+    int body_mode;       // BODY_SENDFILE → BODY_SPLICE → BODY_COPYの順にフォールバックする
+    off_t body_offset;
+    off_t body_remain;
+    int pipefd[2];       // splice(2)用のパイプ
+    size_t piped;
+    char *blockbuf;
+    size_t blocklen;
+    size_t blockpos;
+    int uring_op;        // io_uringに投入中の操作（UOP_*）
+    struct HTTPRequest *pending;  // ファイルを調べ終わるのを待っているリクエスト
+    struct FileInfo *lookup;      // 先に調べておいたFileInfo。do_file_respond()はこれを使う
+    struct FileInfo *listing;     // 先に描画しておいたディレクトリ一覧。respond_listing()はこれを使う
+    struct statx *stx;
+    struct FileTask *task;        // スレッドプールで処理中のファイル操作
+    struct msghdr msg;
+    struct iovec iov[2];
+    char peer[INET6_ADDRSTRLEN];  // アクセスログに書くクライアントのアドレス。最初に書く時に調べる
+    long long t_request;   // 次のリクエストの最初のバイトを受け取った時刻(us)。まだなら0
+    long long t_start;     // 応答中のリクエストの最初のバイトを受け取った時刻
+    long long t_lookup;    // ファイルを調べ始めた時刻
+    long long t_response;  // レスポンスを用意し終えた時刻
+    long lookup_us;        // レスポンスを用意する間にファイルを調べるのにかかった時間
+    int status;            // 応答中のステータスコード
+    long response_bytes;   // 送り終えたら統計に足すバイト数
+    int upload_fd;         // アップロードのボディを書いている一時ファイル
+    char *upload_tmp;      // 一時ファイルのパス。書き終えたらupload_pathへrename(2)する
+    char *upload_path;
+    off_t upload_remain;   // まだ受け取っていないボディのバイト数
+    off_t upload_size;     // ファイルに書き終えたバイト数
+    int upload_status;     // 返すステータスコード
+    struct HandlerChannel *call_channel;  // 動的なハンドラの応答を待っている間はその接続
+    unsigned int call_id;
+    struct Connection *call_next;  // 同じハンドラの応答を待っている次の接続。応答が届いたら再開待ちのリスト
+    int replied;           // ハンドラの応答が届いたか、呼び出しに失敗した
+    char *reply;           // ハンドラの応答（CGIと同じ形のヘッダとボディ）。失敗したらNULL
+    size_t reply_len;
+};
+
+// ハンドラとの間でやりとりするフレームの先頭。この後にlenバイトの要求か応答が続く
+struct HandlerFrame {
+    uint32_t id;
+    uint32_t len;
+};
+
+// ハンドラ1つへの接続。要求をフレームにして次々に書き、応答はidで待っている接続に返す
+struct HandlerChannel {
+    struct EventSource source;      // epollでは読み書きとも、io_uringでは読み込みを待つPOLL_ADDに使う
+    struct EventSource out_source;
+    int index;
+    int fd;                 // 繋がっていなければ-1
+    int events;             // epollに登録中のイベント
+    int polling;            // io_uringに投入中のPOLL_ADD（POLLIN/POLLOUTのビット）
+    int dirty;              // 監視するイベントを見直す
+    struct HandlerChannel *dirty_next;
+    unsigned int next_id;
+    struct OutputBuffer out;  // 書ききれていないフレーム
+    size_t outpos;
+    char *in;
+    size_t inlen;
+    size_t incap;
+    struct Connection *calls;  // 応答を待っている接続
+    int ncalls;
+    long long backoff_until;   // 最後に接続が切れた時刻(us)+HANDLER_BACKOFF_US
+};
+
+// 1マイクロ秒から2のべき乗ごとに4つに分けたバケットで数える。どの桁でも誤差は最大25%
+struct LatencyHistogram {
+    unsigned long count;
+    unsigned long sum_us;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+// ワーカーごとの統計。--workers指定時はマスターとワーカーで共有するメモリに置く
+struct WorkerStats {
+    pid_t pid;
+    unsigned long accepted;
+    unsigned long file_cache_hits;
+    unsigned long file_cache_misses;
+    unsigned long hot_cache_hits;
+    unsigned long hot_cache_bytes;
+    unsigned long compressed_responses;
+    unsigned long gzip_cache_bytes;
+    unsigned long pool_tasks;        // スレッドプールで終えたファイル操作の数
+    unsigned long pool_queue_depth;  // 投入済みでまだどのスレッドも取り出していない数
+    unsigned long pool_wait_us;      // キューで待った時間の合計
+    unsigned long pool_run_us;       // 実行にかかった時間の合計
+    unsigned long pool_max_run_us;
+    unsigned long pool_steals;       // 他のスレッドのキューから取ってきた数
+    unsigned long requests;          // 送り終えたレスポンスの数
+    unsigned long bytes_sent;
+    unsigned long status[6];         // ステータスコードの百の位ごとの数
+    long rate_second[RATE_WINDOW];   // 直近の各秒の時刻と、その秒に送り終えたレスポンスの数
+    unsigned long rate_count[RATE_WINDOW];
+    struct LatencyHistogram stages[STAGE_COUNT];
+    unsigned long access_log_lines;    // ファイルに書いた行数
+    unsigned long access_log_dropped;  // リングが一杯か書き込みに失敗して捨てた行数
+    unsigned long timeouts[TIMEOUT_KINDS];  // 待ちきれなかった数。TIMEOUT_*ごと
+    unsigned long handler_calls;       // 動的なハンドラに渡したリクエストの数
+    unsigned long handler_failures;    // ハンドラに渡せなかったか、応答がおかしくて502を返した数
+    unsigned long uploads;             // 置き換えるか作ったファイルの数
+    unsigned long upload_bytes;
+    unsigned long listing_renders;     // ディレクトリ一覧を描画し直した回数
+};
+
+// アクセスログ1行分の枠。seqは書き手と読み手のどちらの番かを表す
+struct LogSlot {
+    unsigned long seq;
+    unsigned int len;
+    char line[ACCESS_LOG_LINE_SIZE];
+};
+
+// ワーカーごとのアクセスログのリング。書き手はCASで枠を取り、1本のスレッドがまとめてファイルに書く。
+// forkモードの子プロセスも書き込めるように共有メモリに置く
+struct LogRing {
+    unsigned long head;  // 次に書き手が取る位置
+    unsigned long tail __attribute__((aligned(64)));  // 次にファイルへ書く位置
+    unsigned long flushed;  // ここまでは書き終えた
+    struct LogSlot slots[ACCESS_LOG_SLOTS];
+};
+
+struct WatchDir;
+
+// URLパスをキーにしたstat/openの結果。inotifyでディレクトリを監視して変更があれば捨てる
+struct FileCacheEntry {
+    char *key;
+    unsigned int hash;
+    struct FileInfo *info;
+    struct FileCacheEntry *hash_next;
+    struct FileCacheEntry *lru_prev;
+    struct FileCacheEntry *lru_next;
+    struct WatchDir *dir;
+    char *name;          // ディレクトリ内でのファイル名（info->path内を指す）
+    struct FileCacheEntry *dir_prev;
+    struct FileCacheEntry *dir_next;
+};
+
+struct WatchDir {
+    int wd;
+    struct FileCacheEntry *entries;
+    struct WatchDir *next;
+};
+
+struct FileCache {
+    struct EventSource source;
+    int inotify_fd;
+    size_t capacity;
+    size_t count;
+    size_t nbuckets;
+    struct FileCacheEntry **buckets;
+    struct FileCacheEntry *lru_head;  // 最近使った順。末尾から追い出す
+    struct FileCacheEntry *lru_tail;
+    struct WatchDir *dirs;
+};
+
+// ネットワークのループの代わりにスレッドで行うlstat(2)/open(2)と先読み
+struct FileTask {
+    struct FileTask *next;       // 完了リストでの次
+    struct Connection *conn;
+    struct FileInfo *info;       // ループはタスクが終わるまで触らない
+    struct HTTPRequest *req;
+    struct timespec queued;
+    char *dirpath;               // index.htmlがなければ一覧を返すディレクトリ。--autoindexでなければNULL
+    struct Listing known;        // 投入時にキャッシュにあった一覧の状態。pathとinfoはスレッドからは見ない
+    struct stat dirst;
+    struct timespec rendered;
+    struct FileInfo *listing;    // スレッドで描画し直した一覧
+};
+
+// スレッドごとのキュー。空になったら他のスレッドのキューから取ってくる
+struct TaskQueue {
+    pthread_mutex_t lock;
+    struct FileTask *items[TASK_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+};
+
+struct ThreadPool {
+    struct EventSource source;
+    int efd;                     // 完了をネットワークのループに知らせるeventfd
+    int nthreads;
+    struct TaskQueue *queues;
+    unsigned next_queue;
+    unsigned long pending;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    struct FileTask *done;       // 完了したタスクのスタック。スレッドはCASで積み、ループはまとめて取り出す
+};
+
+// TinyLFU風の受け入れ判定に使う頻度の見積もり。一定回数ごとに全カウンタを半分にして古い人気を忘れる
+struct FrequencySketch {
+    unsigned char counters[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned long additions;
+};
+
+// ホットキャッシュと圧縮キャッシュで共用する。admissionが0なら頻度を見ずに単純なLRUで追い出す
+struct HotCache {
+    size_t budget;
+    size_t bytes;
+    int admission;
+    unsigned long *bytes_stat;
+    struct HotContent *lru_head;
+    struct HotContent *lru_tail;
+    struct FrequencySketch sketch;
 };
 
 static int debug_mode = 0;
+static int engine = ENGINE_FORK;
+static int workers = 0;
+static int cpu_affinity = 0;
+static int uploads_enabled = 0;  // PUT/POSTのボディをドキュメントルートのファイルとして保存する
+static int autoindex = 0;        // index.htmlのないディレクトリには一覧を返す
+static char *handler_prefix = NULL;   // このパスで始まるリクエストは動的なハンドラに渡す
+static char *handler_command = NULL;
+static int handler_procs = DEFAULT_HANDLER_PROCS;
+static pid_t handler_owner;           // ハンドラを起動したプロセスのpid
+static unsigned long long handler_token;  // ハンドラのソケットの名前に入れる乱数。名前を先回りして取られないようにする
+static pid_t handler_supervisor = 0;
+static int listen_backlog = DEFAULT_BACKLOG;
+static int defer_accept = 0;
+static int fastopen_queue = 0;
+static int accept_fd = -1;       // このプロセスが受け付けているリスニングソケット
+static int netstat_fd = -1;
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static int header_timeout = DEFAULT_HEADER_TIMEOUT;
+static int body_timeout = DEFAULT_BODY_TIMEOUT;
+static int file_cache_size = DEFAULT_FILE_CACHE_SIZE;
+static struct FileCache *file_cache = NULL;
+static long hot_cache_budget = DEFAULT_HOT_CACHE_BYTES;
+static struct HotCache *hot_cache = NULL;
+static long gzip_cache_budget = DEFAULT_GZIP_CACHE_BYTES;
+static struct HotCache *gzip_cache = NULL;
+static struct Listing listings[LISTING_CACHE_SIZE];
+static struct MimeType *extra_mime_types = NULL;  // --mime-typesで読んだ表。組み込みの表より優先する
+static size_t extra_mime_count = 0;
+static int io_threads = DEFAULT_IO_THREADS;
+static struct ThreadPool *thread_pool = NULL;
+static const char *encoding_names[ENC_COUNT] = {NULL, "gzip", "br"};
+static const char *encoding_suffixes[ENC_COUNT] = {NULL, ".gz", ".br"};
+static const char *stage_names[STAGE_COUNT] = {"read", "lookup", "respond", "send", "total"};
+// /proc/net/netstatのTcpExtから読む項目。受け付けキューとSYNキューがあふれた回数
+static const char *listen_counter_names[LISTEN_COUNTERS] = {"ListenOverflows", "ListenDrops", "TCPReqQFullDrop",
+                                                            "TCPReqQFullDoCookies"};
+static struct WorkerStats *worker_stats = NULL;
+static struct WorkerStats *my_stats = NULL;
+static char *stats_path = NULL;
+static char **saved_argv;
+static char exe_path[PATH_MAX];  // 起動した時のバイナリのパス。SIGUSR2ではここにある新しいバイナリを起動する
+static char *start_cwd;
+static int chrooted = 0;
+static int draining = 0;         // 受け付けをやめて、処理中の接続が終わるのを待っている
+static time_t drain_deadline;
+static int live_connections = 0;
+static int access_log_fd = -1;
+static struct LogRing *access_log = NULL;
+static time_t start_time;
 
 static struct option longopts[] = {
         {"debug",  no_argument,       &debug_mode, 1},
@@ -62,30 +682,85 @@ static struct option longopts[] = {
         {"user",   required_argument, NULL,        'u'},
         {"group",  required_argument, NULL,        'g'},
         {"port",   required_argument, NULL,        'p'},
+        {"engine", required_argument, NULL,        'e'},
+        {"workers", required_argument, NULL,       'w'},
+        {"cpu-affinity", no_argument, &cpu_affinity, 1},
+        {"backlog", required_argument, NULL,       'b'},
+        {"defer-accept", required_argument, NULL,  'D'},
+        {"fastopen", required_argument, NULL,      'F'},
+        {"header-timeout", required_argument, NULL, 'T'},
+        {"body-timeout", required_argument, NULL,  'B'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"file-cache", required_argument, NULL,    'f'},
+        {"hot-cache", required_argument, NULL,     'H'},
+        {"gzip-cache", required_argument, NULL,    'z'},
+        {"io-threads", required_argument, NULL,    't'},
+        {"stats-path", required_argument, NULL,    'S'},
+        {"access-log", required_argument, NULL,    'L'},
+        {"uploads", no_argument,      &uploads_enabled, 1},
+        {"autoindex", no_argument,    &autoindex, 1},
+        {"mime-types", required_argument, NULL,    'M'},
+        {"handler", required_argument, NULL,       'A'},
+        {"handler-procs", required_argument, NULL, 'P'},
         {"help",   no_argument,       NULL,        'h'},
         {0,        0,                 0,           0}
 };
 
 static void install_signal_handlers(void);
 
-static void service(FILE *in, FILE *out, char *docroot);
+static int load_mime_types(char *path);
+
+static void service(struct Connection *conn, char *docroot);
+
+static int listen_socket(char *port, int reuseport);
+
+static int tune_listener(int sock);
 
-static int listen_socket(char *port);
+static void run_engine(int server_fd, char *docroot);
+
+static void master_main(int *listen_fds, char *docroot);
 
 static void server_main(int server_fd, char *docroot);
 
+static void epoll_server_main(int server_fd, char *docroot);
+
+#ifdef HAVE_IO_URING
+static void uring_server_main(int server_fd, char *docroot);
+#endif
+
+static struct WorkerStats *new_shared_stats(int n);
+
 static void become_daemon(void);
 
 static void setup_env(char *root, char *user, char *group);
 
+static int inherited_listen_fds(void);
+
+static void start_handlers(int *listen_fds, int nlisten);
+
+static void notify_ready(void);
+
 int main(int argc, char *argv[]) {
-    int server_fd;
+    int server_fd = -1;
+    int *listen_fds = NULL;
     char *port = NULL;
     char *docroot;
     int do_chroot = 0;
     char *user = NULL;
     char *group = NULL;
-    int opt;
+    int ninherited;
+    int opt, i;
+    ssize_t n;
+
+    // 後継プロセスを同じ引数・同じ作業ディレクトリで起動できるように覚えておく
+    saved_argv = argv;
+    n = readlink("/proc/self/exe", exe_path, sizeof exe_path - 1);
+    if (n > 0) {
+        exe_path[n] = '\0';
+    } else {
+        strncpy(exe_path, argv[0], sizeof exe_path - 1);
+    }
+    start_cwd = getcwd(NULL, 0);
 
     while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
         switch (opt) {
@@ -103,6 +778,138 @@ int main(int argc, char *argv[]) {
             case 'p':
                 port = optarg;
                 break;
+            case 'e':
+                if (strcmp(optarg, "fork") == 0) {
+                    engine = ENGINE_FORK;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+#ifdef HAVE_IO_URING
+                    engine = ENGINE_URING;
+#else
+                    fprintf(stderr, "io_uring is not supported in this build\n");
+                    exit(1);
+#endif
+                } else {
+                    fprintf(stderr, "unknown engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    fprintf(stderr, "invalid number of workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                if (listen_backlog < 1) {
+                    fprintf(stderr, "invalid backlog: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                defer_accept = atoi(optarg);
+                if (defer_accept < 0) {
+                    fprintf(stderr, "invalid defer-accept timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                fastopen_queue = atoi(optarg);
+                if (fastopen_queue < 0) {
+                    fprintf(stderr, "invalid fastopen queue length: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                header_timeout = atoi(optarg);
+                if (header_timeout <= 0) {
+                    fprintf(stderr, "invalid header timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                body_timeout = atoi(optarg);
+                if (body_timeout <= 0) {
+                    fprintf(stderr, "invalid body timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                keepalive_timeout = atoi(optarg);
+                if (keepalive_timeout < 0) {
+                    fprintf(stderr, "invalid keep-alive timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                file_cache_size = atoi(optarg);
+                if (file_cache_size < 0) {
+                    fprintf(stderr, "invalid file cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'H':
+                hot_cache_budget = atol(optarg);
+                if (hot_cache_budget < 0) {
+                    fprintf(stderr, "invalid hot cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                io_threads = atoi(optarg);
+                if (io_threads < 0) {
+                    fprintf(stderr, "invalid number of io threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                gzip_cache_budget = atol(optarg);
+                if (gzip_cache_budget < 0) {
+                    fprintf(stderr, "invalid gzip cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                if (optarg[0] != '/') {
+                    fprintf(stderr, "stats path must start with '/': %s\n", optarg);
+                    exit(1);
+                }
+                stats_path = optarg;
+                break;
+            case 'L':
+                // chrootや権限を手放す前に開いておく
+                access_log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (access_log_fd < 0) {
+                    fprintf(stderr, "cannot open access log %s: %s\n", optarg, strerror(errno));
+                    exit(1);
+                }
+                break;
+            case 'A':
+                // argvは後継プロセスの起動に使うので書き換えずに複製する
+                handler_command = strchr(optarg, '=');
+                if (optarg[0] != '/' || !handler_command || handler_command[1] == '\0') {
+                    fprintf(stderr, "invalid handler (expected /prefix=command): %s\n", optarg);
+                    exit(1);
+                }
+                handler_prefix = strndup(optarg, handler_command - optarg);
+                handler_command++;
+                break;
+            case 'P':
+                handler_procs = atoi(optarg);
+                if (handler_procs <= 0) {
+                    fprintf(stderr, "invalid number of handler processes: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                if (load_mime_types(optarg) < 0) {
+                    fprintf(stderr, "cannot read MIME types from %s: %s\n", optarg, strerror(errno));
+                    exit(1);
+                }
+                break;
             case 'h':
                 fprintf(stdout, USAGE, argv[0]);
                 exit(0);
@@ -117,19 +924,56 @@ int main(int argc, char *argv[]) {
     }
 
     docroot = argv[optind];
+    // 受け付けキューのあふれをchrootした後でも数えられるように開いておく
+    netstat_fd = open("/proc/net/netstat", O_RDONLY | O_CLOEXEC);
 
     if (do_chroot) {
         setup_env(docroot, user, group);
         docroot = "";
+        chrooted = 1;
     }
     install_signal_handlers();
-    server_fd = listen_socket(port);
+    start_time = time(NULL);
+    // ワーカーやforkした子プロセスが数えた統計をどのプロセスからも読めるように共有メモリに置く
+    worker_stats = new_shared_stats(workers > 0 ? workers : 1);
+    my_stats = worker_stats;
+    // 前のプロセスからソケットを引き継いだ場合はbind(2)し直さず、オプションとバックログだけ設定し直す
+    ninherited = inherited_listen_fds();
+    for (i = 0; i < ninherited && i < (workers > 0 ? workers : 1); i++) {
+        if (tune_listener(LISTEN_FDS_START + i) < 0) {
+            log_exit("listen(2) failed: %s", strerror(errno));
+        }
+    }
+    if (workers > 0) {
+        // ワーカーごとにSO_REUSEPORTのソケットを用意し、カーネルに接続を振り分けさせる
+        listen_fds = xmalloc(sizeof(int) * workers);
+        for (i = 0; i < workers; i++) {
+            listen_fds[i] = i < ninherited ? LISTEN_FDS_START + i : listen_socket(port, 1);
+        }
+    } else {
+        server_fd = ninherited > 0 ? LISTEN_FDS_START : listen_socket(port, 0);
+    }
+    for (i = workers > 0 ? workers : 1; i < ninherited; i++) {
+        close(LISTEN_FDS_START + i);
+    }
     if (!debug_mode) {
         openlog("test", LOG_PID | LOG_NDELAY, LOG_DAEMON);
         become_daemon();
     }
+    if (handler_command) {
+        if (workers > 0) {
+            start_handlers(listen_fds, workers);
+        } else {
+            start_handlers(&server_fd, 1);
+        }
+    }
+    notify_ready();
 
-    server_main(server_fd, docroot);
+    if (workers > 0) {
+        master_main(listen_fds, docroot);
+    } else {
+        run_engine(server_fd, docroot);
+    }
     exit(0);
 }
 
@@ -171,7 +1015,7 @@ static void setup_env(char *root, char *user, char *group) {
     }
 }
 
-static int listen_socket(char *port) {
+static int listen_socket(char *port, int reuseport) {
     struct addrinfo hints, *res, *ai;
     int err;
 
@@ -192,6 +1036,11 @@ static int listen_socket(char *port) {
             fprintf(stderr, "failed socket(2): sock = %d\n", sock);
             continue;
         }
+        if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof reuseport) < 0) {
+            fprintf(stderr, "failed setsockopt(2) SO_REUSEPORT: %s\n", strerror(errno));
+            close(sock);
+            continue;
+        }
         if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
             perror("bind");
             fprintf(stderr, "failed bind(2): sock = %d, ai_addr=%s, ai_addrlen=%d\n",
@@ -199,7 +1048,7 @@ static int listen_socket(char *port) {
             close(sock);
             continue;
         }
-        if (listen(sock, MAX_BACKLOG) < 0) {
+        if (tune_listener(sock) < 0) {
             fprintf(stderr, "failed listen(2): sock = %d\n", sock);
             close(sock);
             continue;
@@ -211,6 +1060,19 @@ static int listen_socket(char *port) {
     return -1; // not reach
 }
 
+// TCP_DEFER_ACCEPTはリクエストのデータが届くまで受け付けを知らせない。0を設定すれば解除される。
+// TCP_FASTOPENはSYNに載ってきたリクエストを3ウェイハンドシェイクの完了を待たずに受け取る
+static int tune_listener(int sock) {
+    if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof defer_accept) < 0) {
+        fprintf(stderr, "failed setsockopt(2) TCP_DEFER_ACCEPT: %s\n", strerror(errno));
+    }
+    if (fastopen_queue > 0
+        && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof fastopen_queue) < 0) {
+        fprintf(stderr, "failed setsockopt(2) TCP_FASTOPEN: %s\n", strerror(errno));
+    }
+    return listen(sock, listen_backlog);
+}
+
 static void become_daemon(void) {
     int n;
 
@@ -236,352 +1098,6169 @@ static void become_daemon(void) {
     }
 }
 
-static void server_main(int server_fd, char *docroot) {
-    for (;;) {
-        struct sockaddr_storage addr;
-        socklen_t addrlen = sizeof addr;
-        int sock;
-        int pid;
-
-        sock = accept(server_fd, (struct sockaddr *) &addr, &addrlen);
-        if (sock < 0) {
-            log_exit("accept(2) failed: %s", strerror(errno));
-        }
-
-        pid = fork();
-        if (pid < 0) {
-            exit(3);
-        }
-
-        // 子プロセス
-        if (pid == 0) {
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
-            service(inf, outf, docroot);
-            exit(0);
-        }
+static void start_access_log(void);
 
-        close(sock);
+static void run_engine(int server_fd, char *docroot) {
+    accept_fd = server_fd;
+    if (access_log_fd >= 0) {
+        start_access_log();
+    }
+    if (engine == ENGINE_EPOLL) {
+        epoll_server_main(server_fd, docroot);
+#ifdef HAVE_IO_URING
+    } else if (engine == ENGINE_URING) {
+        uring_server_main(server_fd, docroot);
+#endif
+    } else {
+        server_main(server_fd, docroot);
     }
 }
 
-static struct HTTPRequest *read_request(FILE *in);
+static volatile sig_atomic_t master_signal = 0;
 
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
+static void master_signal_handler(int sig) {
+    master_signal = sig;
+}
 
-static void free_request(struct HTTPRequest *req);
+// 待っているシステムコールから抜けてループで扱えるように、SA_RESTARTを付けずに設定する。
+// --workers指定時のワーカーはSIGQUITだけを受け、後継の起動と統計の報告はマスターに任せる
+static void trap_control_signals(void) {
+    struct sigaction act;
 
-static void service(FILE *in, FILE *out, char *docroot) {
-    struct HTTPRequest *req;
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    act.sa_handler = master_signal_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGQUIT, &act, NULL) < 0) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+    if (workers == 0 && (sigaction(SIGUSR1, &act, NULL) < 0 || sigaction(SIGHUP, &act, NULL) < 0
+                         || sigaction(SIGUSR2, &act, NULL) < 0)) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in);
-
-static struct HTTPHeaderField *read_header_field(FILE *in);
+static void read_listen_counters(unsigned long *values);
 
-static long content_length(struct HTTPRequest *req);
+// --workersなしの場合は自プロセスをワーカー0として報告する
+static void report_worker_stats(void) {
+    unsigned long counters[LISTEN_COUNTERS];
+    unsigned long tasks;
+    int i;
 
-static struct HTTPRequest *read_request(FILE *in) {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    for (i = 0; i < (workers > 0 ? workers : 1); i++) {
+        tasks = __atomic_load_n(&worker_stats[i].pool_tasks, __ATOMIC_RELAXED);
+        log_info("worker %d (pid %d): %lu connections accepted, file cache %lu hits / %lu misses,"
+                 " hot cache %lu hits / %lu bytes, %lu compressed responses, gzip cache %lu bytes,"
+                 " io pool %lu tasks / depth %lu / avg wait %lu us / avg run %lu us / max run %lu us / %lu steals,"
+                 " access log %lu lines / %lu dropped",
+                 i, (int) worker_stats[i].pid,
+                 __atomic_load_n(&worker_stats[i].accepted, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].file_cache_hits, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].file_cache_misses, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].hot_cache_hits, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].hot_cache_bytes, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].compressed_responses, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].gzip_cache_bytes, __ATOMIC_RELAXED),
+                 tasks,
+                 __atomic_load_n(&worker_stats[i].pool_queue_depth, __ATOMIC_RELAXED),
+                 tasks ? __atomic_load_n(&worker_stats[i].pool_wait_us, __ATOMIC_RELAXED) / tasks : 0,
+                 tasks ? __atomic_load_n(&worker_stats[i].pool_run_us, __ATOMIC_RELAXED) / tasks : 0,
+                 __atomic_load_n(&worker_stats[i].pool_max_run_us, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].pool_steals, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].access_log_lines, __ATOMIC_RELAXED),
+                 __atomic_load_n(&worker_stats[i].access_log_dropped, __ATOMIC_RELAXED));
+    }
+    read_listen_counters(counters);
+    log_info("listen queue (whole host): %lu overflows, %lu drops, %lu SYN queue drops, %lu SYN cookies sent",
+             counters[0], counters[1], counters[2], counters[3]);
+}
 
-    req = xmalloc(sizeof(struct HTTPRequest));
-    read_request_line(req, in);
+// カウンタはネットワーク名前空間全体のもので、このサーバのソケットだけの数ではない
+static void read_listen_counters(unsigned long *values) {
+    char buf[8192];
+    char *names, *nums, *name, *num, *names_save, *nums_save;
+    ssize_t n;
+    int i;
 
-    req->header = NULL;
-    while ((h = read_header_field(in)) != NULL) {
-        h->next = req->header;
-        req->header = h;
+    memset(values, 0, sizeof(unsigned long) * LISTEN_COUNTERS);
+    if (netstat_fd < 0) {
+        return;
     }
-
-    req->length = content_length(req);
-    if (req->length != 0) {
-        if (req->length > MAX_REQUEST_BODY_LENGTH) {
-            log_exit("request body too long");
-        }
-        req->body = xmalloc(req->length);
-        if (fread(req->body, req->length, 1, in) < 1) {
-            log_exit("failed to read request body");
+    n = pread(netstat_fd, buf, sizeof buf - 1, 0);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
+    // 「TcpExt: 名前...」の行と「TcpExt: 値...」の行が続いている
+    names = strstr(buf, "TcpExt:");
+    if (!names || !(nums = strstr(names + 1, "TcpExt:"))) {
+        return;
+    }
+    nums[-1] = '\0';
+    if ((num = strchr(nums, '\n'))) {
+        *num = '\0';
+    }
+    name = strtok_r(names + 7, " ", &names_save);
+    num = strtok_r(nums + 7, " ", &nums_save);
+    while (name && num) {
+        for (i = 0; i < LISTEN_COUNTERS; i++) {
+            if (strcmp(name, listen_counter_names[i]) == 0) {
+                values[i] = strtoul(num, NULL, 10);
+            }
         }
-    } else {
-        req->body = NULL;
+        name = strtok_r(NULL, " ", &names_save);
+        num = strtok_r(NULL, " ", &nums_save);
     }
-    return req;
 }
 
-static void upcase(char *str) {
-    char *p;
-    for (p = str; *p; p++) {
-        *p = (char) toupper((int) *p);
+static struct WorkerStats *new_shared_stats(int n) {
+    struct WorkerStats *stats;
+
+    stats = mmap(NULL, sizeof(struct WorkerStats) * n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
     }
+    return stats;
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in) {
-    char buf[LINE_BUF_SIZE];
-    char *path, *p;
+static long long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// 4未満はそのまま、それ以上は最上位ビットの位置と次の2ビットでバケットを決める
+static int hist_bucket(unsigned long us) {
+    int msb;
 
-    // 一行読み込み「GET /path/to/file HTTP/1.0\0」のような文字列を受け取る
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        log_exit("no request line");
+    if (us < 4) {
+        return (int) us;
     }
+    msb = 63 - __builtin_clzl(us);
+    if ((msb - 1) * 4 + 3 >= HIST_BUCKETS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (msb - 1) * 4 + (int) ((us >> (msb - 2)) & 3);
+}
 
-    // 1つ目の空白までポインタpを移動
-    p = strchr(buf, ' ');
-    if (!p) {
-        log_exit("parse error on request line (1): %s", buf);
+// バケットに入る最小の値
+static unsigned long hist_bucket_floor(int index) {
+    if (index < 4) {
+        return index;
     }
-    // 空白部分をヌル文字で上書きして、ポインタを1つ進める
-    *p++ = '\0';
+    return (4UL | (index & 3)) << (index / 4 - 1);
+}
 
-    // ポインタpが "GET "の後ろのアドレスを指しているので、bufのアドレスで減算すると、HTTPメソッドの文字列サイズが取得できる
-    req->method = xmalloc(p - buf);
-    // bufからreq->methodへコピー／strcpyはヌル文字を発見するまでコピーするらしい
-    strcpy(req->method, buf);
-    // 大文字に変更する独自関数
-    upcase(req->method);
+// ワーカーは自分の分しか書かないが、forkモードの子プロセス同士は同じ領域を更新するのでアトミックに足す
+static void record_latency(int stage, long long us) {
+    struct LatencyHistogram *h = &my_stats->stages[stage];
 
-    // ポインタpathに現在のアドレスをセット
-    path = p;
-    // 2つ目の空白までポインタpを移動
-    p = strchr(path, ' ');
-    if (!p) {
-        log_exit("parse error on request line (2): %s", buf);
+    if (us < 0) {
+        us = 0;
     }
-    // 空白部分をヌル文字で上書きして、ポインタを1つ進める
-    *p++ = '\0';
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, (unsigned long) us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+}
 
-    // ポインタpathにパスの先頭アドレスが入っているので、それをポインタpから減算すると、パスの文字列サイズが取得できる
-    req->path = xmalloc(p - path);
-    // pathからreq->pathへコピー
-    strcpy(req->path, path);
+// ヘッダを読み終えたところ。ここまでが受信の段階
+static void request_parsed(struct Connection *conn) {
+    long long t = now_us();
 
-    // HTTPのバージョンを確認／HTTP1系しか受け付けない
-    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0) {
-        log_exit("parse error on request line (3): %s", buf);
-    }
-    // ポインタpをHTTPのマイナーバージョンまで進める
-    p += strlen("HTTP/1.");
-    // HTTPのマイナーバージョンをセット
-    req->protocol_minor_version = atoi(p);
+    conn->t_start = conn->t_request ? conn->t_request : t;
+    conn->t_request = 0;
+    conn->lookup_us = 0;
+    record_latency(STAGE_READ, t - conn->t_start);
 }
 
-static struct HTTPHeaderField *read_header_field(FILE *in) {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
+// 用意したレスポンスのステータスコードと、ヘッダとボディを合わせた大きさを覚えておく
+static void response_ready(struct Connection *conn, long long since) {
+    long bytes = (long) conn->out.len + conn->body_remain;
+    int i;
 
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        log_exit("failed to read request header field: %s", strerror(errno));
-    }
-    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0)) {
-        return NULL;
+    conn->t_response = now_us();
+    record_latency(STAGE_RESPOND, conn->t_response - since - conn->lookup_us);
+    for (i = 1; i < conn->nsegments; i++) {
+        bytes += conn->segments[i].length;
     }
+    conn->response_bytes = bytes;
+    conn->status = conn->out.len > 12 ? atoi(conn->out.data + 9) : 0;
+}
 
-    p = strchr(buf, ':');
-    if (!p) {
-        log_exit("parse error on request header field: %s", buf);
+// レスポンスを送り終えた時に呼ぶ
+static void finish_response(struct Connection *conn) {
+    long long t = now_us();
+    long sec = (long) time(NULL);
+    int slot = (int) (sec % RATE_WINDOW);
+    int class = conn->status / 100;
+
+    record_latency(STAGE_SEND, t - conn->t_response);
+    record_latency(STAGE_TOTAL, t - conn->t_start);
+    __atomic_fetch_add(&my_stats->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_stats->bytes_sent, (unsigned long) conn->response_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_stats->status[class >= 1 && class <= 5 ? class : 0], 1, __ATOMIC_RELAXED);
+    // 秒が変わって最初に来たものがスロットを空ける。境目で数件ずれることはあるが気にしない
+    if (__atomic_load_n(&my_stats->rate_second[slot], __ATOMIC_RELAXED) != sec) {
+        __atomic_store_n(&my_stats->rate_second[slot], sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&my_stats->rate_count[slot], 0, __ATOMIC_RELAXED);
     }
-    *p++ = '\0';
+    __atomic_fetch_add(&my_stats->rate_count[slot], 1, __ATOMIC_RELAXED);
+}
 
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf);
+// 空き枠がなければ待たずに捨てて数える
+static void log_ring_push(struct LogRing *ring, const char *line, size_t len) {
+    unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    struct LogSlot *slot;
+    long diff;
 
-    p += strspn(p, " \t");
-    h->value = xmalloc(strlen(p) + 1);
-    strcpy(h->value, p);
+    for (;;) {
+        slot = &ring->slots[pos & (ACCESS_LOG_SLOTS - 1)];
+        diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            // 失敗するとposは最新のheadに更新される
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&my_stats->access_log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(slot->line, line, len);
+    slot->len = (unsigned int) len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
 
-    return h;
+// 失敗したらバッチごと捨てて数える。forkした子プロセスを止めないよう、ここではsyslogもmallocも使わない
+static void write_access_log(const char *buf, size_t len, unsigned long lines) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(access_log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            __atomic_fetch_add(&my_stats->access_log_dropped, lines, __ATOMIC_RELAXED);
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+    __atomic_fetch_add(&my_stats->access_log_lines, lines, __ATOMIC_RELAXED);
 }
 
-static char *lookup_header_field_value(struct HTTPRequest *req, char *name) {
-    struct HTTPHeaderField *h;
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0) {
-            return h->value;
+// リングから取り出した行をバッファに溜め、一杯になるかリングが空になったところで1回のwrite(2)で書く
+static void *access_log_main(void *arg) {
+    static char buf[ACCESS_LOG_BATCH];
+    struct LogRing *ring = arg;
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_MS * 1000000L};
+    struct LogSlot *slot;
+    size_t len = 0;
+    unsigned long lines = 0;
+
+    for (;;) {
+        slot = &ring->slots[ring->tail & (ACCESS_LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ring->tail + 1) {
+            if (len + slot->len > sizeof buf) {
+                write_access_log(buf, len, lines);
+                len = 0;
+                lines = 0;
+            }
+            memcpy(buf + len, slot->line, slot->len);
+            len += slot->len;
+            lines++;
+            __atomic_store_n(&slot->seq, ring->tail + ACCESS_LOG_SLOTS, __ATOMIC_RELEASE);
+            ring->tail++;
+            continue;
         }
+        if (len > 0) {
+            write_access_log(buf, len, lines);
+            len = 0;
+            lines = 0;
+        }
+        __atomic_store_n(&ring->flushed, ring->tail, __ATOMIC_RELEASE);
+        nanosleep(&interval, NULL);
     }
     return NULL;
 }
 
-static long content_length(struct HTTPRequest *req) {
-    char *val;
-    long len;
+static void start_access_log(void) {
+    pthread_t thread;
+    sigset_t all, saved;
+    unsigned long i;
+    int err;
 
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) {
-        return 0;
+    access_log = mmap(NULL, sizeof(struct LogRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (access_log == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
     }
-    len = atoi(val);
-    if (len < 0) {
-        log_exit("negative Content-Length value");
+    for (i = 0; i < ACCESS_LOG_SLOTS; i++) {
+        access_log->slots[i].seq = i;
     }
-    return len;
-}
 
-static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    err = pthread_create(&thread, NULL, access_log_main, access_log);
+    if (err != 0) {
+        log_exit("pthread_create failed: %s", strerror(err));
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
 
-static void method_not_allowed(struct HTTPRequest *req, FILE *out);
+// Combined Log Formatの日時。1秒に1回だけ作り直す
+static char *log_date(void) {
+    static char buf[HTTP_DATE_SIZE];
+    static time_t cached = 0;
+    struct tm tm;
+    time_t t;
 
-static void not_implemented(struct HTTPRequest *req, FILE *out);
+    t = time(NULL);
+    if (t != cached) {
+        localtime_r(&t, &tm);
+        strftime(buf, sizeof buf, "%d/%b/%Y:%H:%M:%S %z", &tm);
+        cached = t;
+    }
+    return buf;
+}
 
-static void not_found(struct HTTPRequest *req, FILE *out);
+// 引用符や制御文字は\xHHにする。行に収まらない分は切り捨てる
+static size_t log_escape(char *line, size_t len, const char *str) {
+    unsigned char c;
 
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot) {
-    if (strcmp(req->method, "GET") == 0) {
-        do_file_respond(req, out, docroot);
-    } else if (strcmp(req->method, "HEAD") == 0) {
-        do_file_respond(req, out, docroot);
+    for (; *str && len < ACCESS_LOG_LINE_SIZE - 64; str++) {
+        c = (unsigned char) *str;
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+            len += sprintf(line + len, "\\x%02x", c);
+        } else {
+            line[len++] = (char) c;
+        }
+    }
+    return len;
+}
+
+static const char *header_or_dash(struct HTTPRequest *req, enum HeaderId id) {
+    return req && req->known[id] ? req->known[id]->value : "-";
+}
+
+// 用意し終えたレスポンスについてCombined Log Formatの1行をリングに入れる。%bはヘッダを除いたボディの大きさ
+static void log_access(struct Connection *conn, struct HTTPRequest *req) {
+    char line[ACCESS_LOG_LINE_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    char *end;
+    long body;
+    size_t len;
+
+    if (!access_log) {
+        return;
+    }
+    if (conn->peer[0] == '\0') {
+        if (getpeername(conn->sock, (struct sockaddr *) &addr, &addrlen) < 0
+            || getnameinfo((struct sockaddr *) &addr, addrlen, conn->peer, sizeof conn->peer, NULL, 0,
+                           NI_NUMERICHOST) != 0) {
+            strcpy(conn->peer, "-");
+        }
+    }
+    end = memmem(conn->out.data, conn->out.len, "\r\n\r\n", 4);
+    body = conn->response_bytes - (long) (end ? end + 4 - conn->out.data : (long) conn->out.len);
+
+    len = snprintf(line, sizeof line, "%s - - [%s] \"", conn->peer, log_date());
+    if (req) {
+        len = log_escape(line, len, req->method);
+        line[len++] = ' ';
+        len = log_escape(line, len, req->path);
+        len += sprintf(line + len, " HTTP/1.%d", req->protocol_minor_version);
+    } else {
+        line[len++] = '-';
+    }
+    len += sprintf(line + len, body > 0 ? "\" %d %ld \"" : "\" %d - \"", conn->status, body);
+    len = log_escape(line, len, header_or_dash(req, HDR_REFERER));
+    len += sprintf(line + len, "\" \"");
+    len = log_escape(line, len, header_or_dash(req, HDR_USER_AGENT));
+    len += sprintf(line + len, "\"\n");
+    log_ring_push(access_log, line, len);
+}
+
+// systemdと同じLISTEN_FDS/LISTEN_PIDで渡されたリスニングソケットの数。自分宛てでなければ0
+static int inherited_listen_fds(void) {
+    char *fds = getenv("LISTEN_FDS");
+    char *pid = getenv("LISTEN_PID");
+    int n = 0;
+
+    if (fds && pid && atoi(pid) == (int) getpid()) {
+        n = atoi(fds);
+    }
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    return n > 0 ? n : 0;
+}
+
+// 後継として起動された場合は、受け付けを始められることを前のプロセスに知らせる
+static void notify_ready(void) {
+    char *env = getenv(READY_FD_ENV);
+    char buf[32];
+    int fd, len;
+
+    if (!env) {
+        return;
+    }
+    fd = atoi(env);
+    unsetenv(READY_FD_ENV);
+    len = snprintf(buf, sizeof buf, "%d\n", (int) getpid());
+    if (write(fd, buf, len) < 0) {
+        log_error("failed to notify the previous server: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+// ハンドラiのソケットの名前。抽象名前空間に置くのでchrootしていても繋がり、ファイルも残らない。
+// 抽象名前空間にはパーミッションがないので、名前は推測できないようにし、繋いできた相手はハンドラがSO_PEERCREDで確かめる
+static socklen_t handler_address(struct sockaddr_un *addr, int index) {
+    int n;
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    n = snprintf(addr->sun_path + 1, sizeof addr->sun_path - 1, "server2-handler.%016llx.%d", handler_token, index);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+// systemdのソケット渡しと同じく、リスニングソケットを3番にしてLISTEN_FDS/LISTEN_PIDで知らせる
+static pid_t spawn_handler(int sock) {
+    char buf[16];
+    pid_t pid;
+
+    pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    // 監視プロセスがいなくなったら一緒に終わる
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (sock == LISTEN_FDS_START) {
+        fcntl(sock, F_SETFD, 0);
+    } else if (dup2(sock, LISTEN_FDS_START) < 0) {
+        _exit(127);
+    }
+    snprintf(buf, sizeof buf, "%d", (int) getpid());
+    setenv("LISTEN_FDS", "1", 1);
+    setenv("LISTEN_PID", buf, 1);
+    signal(SIGPIPE, SIG_DFL);
+    execl(handler_command, handler_command, (char *) NULL);
+    log_error("failed to exec %s: %s", handler_command, strerror(errno));
+    _exit(127);
+}
+
+// ハンドラが終了したら同じリスニングソケットで起動し直す。その間に来た接続はキューで待つので失われない
+static void supervise_handlers(int *socks) {
+    pid_t *pids, pid;
+    time_t *started;
+    int i, status;
+
+    pids = xmalloc(sizeof(pid_t) * handler_procs);
+    started = xmalloc(sizeof(time_t) * handler_procs);
+    for (i = 0; i < handler_procs; i++) {
+        pids[i] = spawn_handler(socks[i]);
+        started[i] = time(NULL);
+    }
+    for (;;) {
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_exit("wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < handler_procs && pids[i] != pid; i++) {
+        }
+        if (i == handler_procs) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            log_error("handler %d (pid %d) killed by signal %d; restarting", i, (int) pid, WTERMSIG(status));
+        } else {
+            log_error("handler %d (pid %d) exited with status %d; restarting", i, (int) pid, WEXITSTATUS(status));
+        }
+        if (time(NULL) - started[i] < HANDLER_RESTART_DELAY) {
+            sleep(HANDLER_RESTART_DELAY);
+        }
+        pids[i] = spawn_handler(socks[i]);
+        started[i] = time(NULL);
+    }
+}
+
+// ハンドラごとのリスニングソケットを作り、ハンドラを起動し続ける監視プロセスをforkする。
+// サーバのプロセスはソケットの名前で繋ぐので、ワーカーでもforkした子プロセスでも同じハンドラを使える
+static void start_handlers(int *listen_fds, int nlisten) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    int *socks;
+    pid_t pid;
+    int i;
+
+    handler_owner = getpid();
+    if (getrandom(&handler_token, sizeof handler_token, 0) != sizeof handler_token) {
+        log_exit("getrandom(2) failed: %s", strerror(errno));
+    }
+    socks = xmalloc(sizeof(int) * handler_procs);
+    for (i = 0; i < handler_procs; i++) {
+        socks[i] = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socks[i] < 0) {
+            log_exit("socket(2) failed: %s", strerror(errno));
+        }
+        len = handler_address(&addr, i);
+        if (bind(socks[i], (struct sockaddr *) &addr, len) < 0 || listen(socks[i], HANDLER_BACKLOG) < 0) {
+            log_exit("failed to listen for handler %d: %s", i, strerror(errno));
+        }
+    }
+    pid = fork();
+    if (pid < 0) {
+        log_exit("fork(2) failed: %s", strerror(errno));
+    }
+    if (pid > 0) {
+        for (i = 0; i < handler_procs; i++) {
+            close(socks[i]);
+        }
+        free(socks);
+        handler_supervisor = pid;
+        return;
+    }
+
+    // 監視プロセス。サーバが終わったら一緒に終わり、ハンドラもそれに続く
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != handler_owner) {
+        _exit(0);
+    }
+    for (i = 0; i < nlisten; i++) {
+        close(listen_fds[i]);
+    }
+    supervise_handlers(socks);
+}
+
+// 子プロセスでリスニングソケットを3番から並べ直し、後継のバイナリをexecする。fork後なのでmallocは使わない
+static void exec_successor(const char *path, int *fds, int *high, int nfds, int ready_fd, char **envp,
+                           char *pid_env, size_t pid_env_size) {
+    int i;
+
+    // 並べ替え先と元の番号が重なってもよいように、いったん上の番号に逃がしてから置き直す
+    for (i = 0; i < nfds; i++) {
+        high[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, LISTEN_FDS_START + nfds + 1);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    ready_fd = fcntl(ready_fd, F_DUPFD_CLOEXEC, LISTEN_FDS_START + nfds + 1);
+    for (i = 0; i < nfds; i++) {
+        if (high[i] < 0 || dup2(high[i], LISTEN_FDS_START + i) < 0) {
+            _exit(127);
+        }
+    }
+    if (ready_fd < 0 || dup2(ready_fd, LISTEN_FDS_START + nfds) < 0) {
+        _exit(127);
+    }
+    snprintf(pid_env, pid_env_size, "LISTEN_PID=%d", (int) getpid());
+    if (start_cwd && chdir(start_cwd) < 0) {
+        _exit(127);
+    }
+    execve(path, saved_argv, envp);
+    _exit(127);
+}
+
+// リスニングソケットを渡して新しいサーバーを起動し、準備ができたと知らせてくるまで待つ。
+// SIGHUPは同じバイナリで設定を読み直し、SIGUSR2は起動時のパスに置かれた新しいバイナリに入れ替える。
+// 後継が起動できなければ-1を返し、このプロセスがそのまま受け付けを続ける
+static int spawn_successor(int *fds, int nfds, int sig) {
+    extern char **environ;
+    static char fds_env[32], pid_env[32], ready_env[64];
+    const char *path = sig == SIGHUP ? "/proc/self/exe" : exe_path;
+    char **envp, **e;
+    int *high;
+    int ready[2], pids[2];
+    struct pollfd pfd;
+    char buf[32];
+    time_t deadline;
+    pid_t pid;
+    int n = 0, ok = 0;
+
+    if (chrooted) {
+        log_error("cannot start a new server inside chroot");
+        return -1;
+    }
+    for (e = environ; *e; e++) {
+        n++;
+    }
+    envp = xmalloc(sizeof(char *) * (n + 4));
+    n = 0;
+    for (e = environ; *e; e++) {
+        if (strncmp(*e, "LISTEN_FDS=", 11) != 0 && strncmp(*e, "LISTEN_PID=", 11) != 0
+            && strncmp(*e, READY_FD_ENV "=", sizeof READY_FD_ENV) != 0) {
+            envp[n++] = *e;
+        }
+    }
+    snprintf(fds_env, sizeof fds_env, "LISTEN_FDS=%d", nfds);
+    snprintf(ready_env, sizeof ready_env, "%s=%d", READY_FD_ENV, LISTEN_FDS_START + nfds);
+    envp[n++] = fds_env;
+    envp[n++] = pid_env;
+    envp[n++] = ready_env;
+    envp[n] = NULL;
+    high = xmalloc(sizeof(int) * nfds);
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        log_error("pipe2(2) failed: %s", strerror(errno));
+        free(envp);
+        free(high);
+        return -1;
+    }
+    if (pipe2(pids, O_CLOEXEC) < 0) {
+        log_error("pipe2(2) failed: %s", strerror(errno));
+        close(ready[0]);
+        close(ready[1]);
+        free(envp);
+        free(high);
+        return -1;
+    }
+
+    // 二重にforkして後継を自分の子にしない。forkエンジンは終了前に子をすべて待つので、後継まで待ってしまう
+    pid = fork();
+    if (pid < 0) {
+        log_error("fork(2) failed: %s", strerror(errno));
+    } else if (pid == 0) {
+        pid = fork();
+        if (pid == 0) {
+            exec_successor(path, fds, high, nfds, ready[1], envp, pid_env, sizeof pid_env);
+        }
+        write(pids[1], &pid, sizeof pid);
+        _exit(0);
+    } else {
+        waitpid(pid, NULL, 0);
+        if (read(pids[0], &pid, sizeof pid) != sizeof pid) {
+            pid = -1;
+        }
+    }
+    free(envp);
+    free(high);
+    close(ready[1]);
+    close(pids[0]);
+    close(pids[1]);
+
+    // 後継が途中で終了すればパイプが閉じられるのですぐに分かる
+    deadline = time(NULL) + UPGRADE_TIMEOUT;
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    while (pid > 0 && time(NULL) < deadline) {
+        n = poll(&pfd, 1, (int) (deadline - time(NULL)) * 1000);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0 && read(ready[0], buf, sizeof buf - 1) > 0;
+        break;
+    }
+    close(ready[0]);
+    if (!ok) {
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+        }
+        log_error("new server %s did not start; keep serving", path);
+        return -1;
+    }
+    log_info("handed %d listening socket(s) over to %s (pid %d)", nfds, path, atoi(buf));
+    return 0;
+}
+
+// ループの合間に届いたシグナルを処理する。受け付けをやめて終了に向かう時は1を返す
+static int handle_control_signal(int *fds, int nfds) {
+    int sig = master_signal;
+
+    master_signal = 0;
+    switch (sig) {
+        case SIGUSR1:
+            report_worker_stats();
+            return 0;
+        case SIGHUP:
+        case SIGUSR2:
+            return !draining && spawn_successor(fds, nfds, sig) == 0;
+        case SIGQUIT:
+            return !draining;
+        default:
+            return 0;
+    }
+}
+
+static void begin_drain(void) {
+    draining = 1;
+    drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+    log_info("stopped accepting; draining %d connection(s)", live_connections);
+}
+
+static int drained(void) {
+    return live_connections == 0 || time(NULL) >= drain_deadline;
+}
+
+// 終了する前に、リングに残っている行をスレッドが書き終えるのを少しだけ待つ
+static void flush_access_log(void) {
+    struct timespec interval = {0, 10 * 1000000L};
+    int i;
+
+    for (i = 0; access_log && i < 100; i++) {
+        if (__atomic_load_n(&access_log->flushed, __ATOMIC_ACQUIRE)
+            == __atomic_load_n(&access_log->head, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+}
+
+static void finish_draining(void) {
+    if (live_connections > 0) {
+        log_error("drain timed out; closing %d connection(s)", live_connections);
+    }
+    flush_access_log();
+    exit(0);
+}
+
+static void pin_worker(int index) {
+    cpu_set_t set;
+    long ncpu;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+        log_error("sched_setaffinity(2) failed: %s", strerror(errno));
+    }
+}
+
+static void trap_signal(int sig, sighandler_t handler);
+
+static pid_t start_worker(int index, int *listen_fds, char *docroot) {
+    pid_t pid;
+    int i;
+
+    pid = fork();
+    if (pid < 0) {
+        log_exit("fork(2) failed: %s", strerror(errno));
+    }
+
+    // ワーカープロセス：自分のリスニングソケット以外は閉じて、単独のサーバとして動く
+    if (pid == 0) {
+        for (i = 0; i < workers; i++) {
+            if (i != index) {
+                close(listen_fds[i]);
+            }
+        }
+        trap_signal(SIGTERM, SIG_DFL);
+        trap_signal(SIGINT, SIG_DFL);
+        trap_signal(SIGUSR1, SIG_IGN);
+        trap_signal(SIGHUP, SIG_IGN);
+        trap_signal(SIGUSR2, SIG_IGN);
+        my_stats = &worker_stats[index];
+        if (cpu_affinity) {
+            pin_worker(index);
+        }
+        run_engine(listen_fds[index], docroot);
+        exit(0);
+    }
+
+    worker_stats[index].pid = pid;
+    return pid;
+}
+
+// ワーカーを起動して見張る。SIGUSR1で接続数を報告し、SIGTERM/SIGINTでワーカーごと終了する。
+// SIGHUP/SIGUSR2で後継を起動するかSIGQUITを受けたら、ワーカーにSIGQUITを送って全員が処理を終えるのを待つ
+static void master_main(int *listen_fds, char *docroot) {
+    struct sigaction act;
+    time_t *started;
+    int running = workers;
+    int i;
+
+    started = xmalloc(sizeof(time_t) * workers);
+
+    // waitpid(2)をEINTRで抜けさせたいのでSA_RESTARTは付けない
+    act.sa_handler = master_signal_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGTERM, &act, NULL) < 0 || sigaction(SIGINT, &act, NULL) < 0
+        || sigaction(SIGUSR1, &act, NULL) < 0 || sigaction(SIGHUP, &act, NULL) < 0
+        || sigaction(SIGUSR2, &act, NULL) < 0 || sigaction(SIGQUIT, &act, NULL) < 0) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+
+    for (i = 0; i < workers; i++) {
+        start_worker(i, listen_fds, docroot);
+        started[i] = time(NULL);
+    }
+
+    for (;;) {
+        int status;
+        pid_t pid;
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                log_exit("waitpid(2) failed: %s", strerror(errno));
+            }
+            if (master_signal == SIGTERM || master_signal == SIGINT) {
+                for (i = 0; i < workers; i++) {
+                    kill(worker_stats[i].pid, SIGTERM);
+                }
+                if (handler_supervisor) {
+                    kill(handler_supervisor, SIGTERM);
+                }
+                while (wait(NULL) > 0 || errno == EINTR) {
+                    ;
+                }
+                report_worker_stats();
+                exit(0);
+            }
+            if (handle_control_signal(listen_fds, workers)) {
+                draining = 1;
+                for (i = 0; i < workers; i++) {
+                    kill(worker_stats[i].pid, SIGQUIT);
+                }
+            }
+            continue;
+        }
+
+        for (i = 0; i < workers; i++) {
+            if (worker_stats[i].pid != pid) {
+                continue;
+            }
+            if (draining) {
+                running--;
+                break;
+            }
+            log_error("worker %d (pid %d) exited with status %d", i, (int) pid, status);
+            // 起動直後に落ち続けるワーカーで fork(2) が空回りしないようにする
+            if (time(NULL) - started[i] < 1) {
+                sleep(1);
+            }
+            start_worker(i, listen_fds, docroot);
+            started[i] = time(NULL);
+            break;
+        }
+        if (draining && running == 0) {
+            report_worker_stats();
+            exit(0);
+        }
+    }
+}
+
+static struct Connection *new_connection(int sock);
+
+static void free_connection(struct Connection *conn);
+
+static void arena_free(struct Arena *arena);
+
+static void free_fileinfo(struct FileInfo *info);
+
+static void release_content(struct HotContent *content);
+
+static void detach_children(void);
+
+static void wait_forked_children(void);
+
+static void set_nonblocking(int fd);
+
+// 接続が届いたらpoll(2)で起き、待っている接続をACCEPT_BATCH個までまとめて受け付けてforkする
+static void server_main(int server_fd, char *docroot) {
+    struct pollfd pfd;
+    int i;
+
+    set_nonblocking(server_fd);
+    detach_children();
+    trap_control_signals();
+    pfd.fd = server_fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (master_signal && handle_control_signal(&server_fd, 1)) {
+            close(server_fd);
+            begin_drain();
+            wait_forked_children();
+            finish_draining();
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR) {
+                log_exit("poll(2) failed: %s", strerror(errno));
+            }
+            continue;
+        }
+        for (i = 0; i < ACCEPT_BATCH; i++) {
+            int sock;
+            int pid;
+
+            // 子プロセスはブロッキングのまま読み書きする
+            sock = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (sock < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (!WOULD_BLOCK(errno)) {
+                    log_error("accept4(2) failed: %s", strerror(errno));
+                }
+                break;
+            }
+            __atomic_fetch_add(&my_stats->accepted, 1, __ATOMIC_RELAXED);
+
+            pid = fork();
+            if (pid < 0) {
+                exit(3);
+            }
+
+            // 子プロセス
+            if (pid == 0) {
+                struct Connection *conn = new_connection(sock);
+                service(conn, docroot);
+                free_connection(conn);
+                exit(0);
+            }
+
+            close(sock);
+        }
+    }
+}
+
+static void set_nonblocking(int fd) {
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    }
+}
+
+static void accept_connections(int epfd, int server_fd);
+
+static void handle_connection(int epfd, struct Connection *conn, char *docroot);
+
+static struct FileCache *new_file_cache(size_t capacity);
+
+static void handle_inotify_events(struct FileCache *cache);
+
+static struct EventSource listener_source = {SOURCE_LISTENER};
+
+static struct TimerWheel wheel;
+
+static unsigned long wheel_clock(void) {
+    return (unsigned long) (now_us() / 1000000);
+}
+
+static void wheel_init(void) {
+    int level, slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            wheel.slots[level][slot].prev = wheel.slots[level][slot].next = &wheel.slots[level][slot];
+        }
+    }
+    wheel.now = wheel_clock();
+    wheel.count = 0;
+}
+
+// 満了までの残りで段を選ぶ。上の段のスロットは、下の段が一周してそこを下ろしてくる時に満了時刻の属する周になる
+static void timer_link(struct Timer *t) {
+    unsigned long delta;
+    struct Timer *head;
+    int level = 0;
+
+    if (t->expires < wheel.now) {
+        t->expires = wheel.now;
+    }
+    delta = t->expires - wheel.now;
+    if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) {
+        t->expires = wheel.now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = t->expires - wheel.now;
+    }
+    while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    head = &wheel.slots[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void timer_unlink(struct Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+static void timer_stop(struct Timer *t) {
+    if (t->kind == TIMEOUT_NONE) {
+        return;
+    }
+    timer_unlink(t);
+    t->kind = TIMEOUT_NONE;
+    wheel.count--;
+}
+
+static void timer_start(struct Timer *t, int kind, int seconds) {
+    timer_stop(t);
+    // 止まっている間は時計を進めていないので、最初のタイマーで合わせる
+    if (wheel.count == 0) {
+        wheel.now = wheel_clock();
+    }
+    t->kind = kind;
+    t->expires = wheel_clock() + seconds;
+    timer_link(t);
+    wheel.count++;
+}
+
+// 上の段のスロットにあるタイマーを、今の時刻から見た段へ入れ直す
+static void wheel_cascade(int level) {
+    struct Timer *head, *t;
+
+    head = &wheel.slots[level][(wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    while (head->next != head) {
+        t = head->next;
+        timer_unlink(t);
+        timer_link(t);
+    }
+}
+
+static int timeout_seconds(int kind) {
+    switch (kind) {
+        case TIMEOUT_HEADER:
+            return header_timeout;
+        case TIMEOUT_BODY:
+            return body_timeout;
+        case TIMEOUT_HANDLER:
+            return HANDLER_TIMEOUT;
+        default:
+            return keepalive_timeout;
+    }
+}
+
+// 読み込みを待つ接続に掛けるタイムアウト。ヘッダは最初のバイトから通しで測り、
+// ボディとキープアライブは何か届くたびに測り直す
+static int read_timeout(struct Connection *conn) {
+    if (conn->state == CONN_UPLOADING || conn->req) {
+        return TIMEOUT_BODY;
+    }
+    if (conn->served > 0 && conn->inlen == 0) {
+        return TIMEOUT_KEEPALIVE;
+    }
+    return TIMEOUT_HEADER;
+}
+
+static void wait_with_timeout(struct Connection *conn) {
+    int kind = read_timeout(conn);
+
+    if (kind == TIMEOUT_HEADER && conn->timer.kind == TIMEOUT_HEADER) {
+        return;
+    }
+    timer_start(&conn->timer, kind, timeout_seconds(kind));
+}
+
+static void count_timeout(int kind) {
+    __atomic_fetch_add(&my_stats->timeouts[kind], 1, __ATOMIC_RELAXED);
+}
+
+static void call_timed_out(struct Connection *conn);
+
+// 今の時刻までに満了したタイマーの接続をexpireで閉じる。1秒ごとに呼べば、各刻みの処理は
+// そのスロットにあるタイマーの数と、64秒ごとの入れ直しだけで済む
+static void run_timers(void (*expire)(struct Connection *conn)) {
+    unsigned long clock = wheel_clock();
+    struct Timer *head, *t;
+    int level, kind;
+
+    while (wheel.now <= clock && wheel.count > 0) {
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel.now & ((1UL << (WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            wheel_cascade(level);
+        }
+        head = &wheel.slots[0][wheel.now & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            t = head->next;
+            kind = t->kind;
+            timer_stop(t);
+            count_timeout(kind);
+            // ハンドラを待っている接続は閉じずに502を返させる
+            if (kind == TIMEOUT_HANDLER) {
+                call_timed_out((struct Connection *) ((char *) t - offsetof(struct Connection, timer)));
+            } else {
+                expire((struct Connection *) ((char *) t - offsetof(struct Connection, timer)));
+            }
+        }
+        wheel.now++;
+    }
+}
+
+// 終了の準備に入ったら、次のリクエストを待っているだけの接続はタイムアウトを待たずに閉じる
+static void close_idle_connections(void (*expire)(struct Connection *conn)) {
+    struct Timer *head, *t, *next;
+    int level, slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            head = &wheel.slots[level][slot];
+            for (t = head->next; t != head; t = next) {
+                next = t->next;
+                if (t->kind == TIMEOUT_KEEPALIVE) {
+                    timer_stop(t);
+                    expire((struct Connection *) ((char *) t - offsetof(struct Connection, timer)));
+                }
+            }
+        }
+    }
+}
+
+static struct HandlerChannel *channels = NULL;  // このプロセスからハンドラへの接続。ハンドラごとに1本
+static struct HandlerChannel *dirty_channels = NULL;
+static struct Connection *answered_calls = NULL;   // ハンドラの応答が届いて、処理の再開を待っている接続
+
+static void out_write(struct OutputBuffer *out, const char *data, size_t len);
+
+static void out_puts(struct OutputBuffer *out, const char *str);
+
+static void setup_channels(void) {
+    int i;
+
+    if (!handler_command) {
+        return;
+    }
+    channels = xmalloc(sizeof(struct HandlerChannel) * handler_procs);
+    memset(channels, 0, sizeof(struct HandlerChannel) * handler_procs);
+    for (i = 0; i < handler_procs; i++) {
+        channels[i].source.type = SOURCE_HANDLER;
+        channels[i].out_source.type = SOURCE_HANDLER_OUT;
+        channels[i].index = i;
+        channels[i].fd = -1;
+        channels[i].out.cap = OUTPUT_BUF_SIZE;
+        channels[i].out.data = xmalloc(channels[i].out.cap);
+        channels[i].incap = INPUT_BUF_SIZE;
+        channels[i].in = xmalloc(channels[i].incap);
+    }
+}
+
+// --handlerの接頭辞で始まるパスならハンドラに渡す
+static int is_handler_request(struct HTTPRequest *req) {
+    return handler_prefix && strncmp(req->path, handler_prefix, strlen(handler_prefix)) == 0;
+}
+
+// ハンドラにはHTTP/1.xのリクエストと同じ形で、リクエスト行・ヘッダ・空行・ボディを渡す
+static void put_handler_request(struct OutputBuffer *out, struct HTTPRequest *req, unsigned int id) {
+    struct HandlerFrame frame;
+    struct HTTPHeaderField *h;
+    size_t start = out->len;
+
+    frame.id = id;
+    frame.len = 0;
+    out_write(out, (char *) &frame, sizeof frame);
+    out_puts(out, req->method);
+    out_puts(out, " ");
+    out_puts(out, req->path);
+    out_puts(out, req->protocol_minor_version ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+    for (h = req->header; h; h = h->next) {
+        out_write(out, h->name, h->name_len);
+        out_puts(out, ": ");
+        out_write(out, h->value, h->value_len);
+        out_puts(out, "\r\n");
+    }
+    out_puts(out, "\r\n");
+    if (req->body && req->length > 0) {
+        out_write(out, req->body, req->length);
+    }
+    frame.len = out->len - start - sizeof frame;
+    memcpy(out->data + start, &frame, sizeof frame);
+}
+
+static void mark_dirty(struct HandlerChannel *ch) {
+    if (!ch->dirty) {
+        ch->dirty = 1;
+        ch->dirty_next = dirty_channels;
+        dirty_channels = ch;
+    }
+}
+
+// call_channelは処理を再開するまで残しておき、その間に届いた接続のイベントは無視させる
+static void call_answered(struct Connection *conn) {
+    timer_stop(&conn->timer);
+    conn->replied = 1;
+    conn->call_next = answered_calls;
+    answered_calls = conn;
+}
+
+// ハンドラが落ちたら待っている呼び出しはすべて502にする。次の呼び出しで繋ぎ直す
+static void fail_channel(struct HandlerChannel *ch, const char *why) {
+    struct Connection *conn, *next;
+
+    log_error("lost connection to handler %d: %s", ch->index, why);
+    ch->backoff_until = now_us() + HANDLER_BACKOFF_US;
+    // io_uringに投入中のPOLL_ADDはclose(2)では終わらないので、shutdown(2)で完了させる
+    shutdown(ch->fd, SHUT_RDWR);
+    close(ch->fd);
+    ch->fd = -1;
+    ch->events = 0;
+    ch->out.len = ch->outpos = 0;
+    ch->inlen = 0;
+    for (conn = ch->calls; conn; conn = next) {
+        next = conn->call_next;
+        call_answered(conn);
+    }
+    ch->calls = NULL;
+    ch->ncalls = 0;
+}
+
+static int connect_channel(struct HandlerChannel *ch) {
+    struct sockaddr_un addr;
+    socklen_t len;
+
+    ch->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ch->fd < 0) {
+        log_error("socket(2) failed: %s", strerror(errno));
+        return -1;
+    }
+    len = handler_address(&addr, ch->index);
+    if (connect(ch->fd, (struct sockaddr *) &addr, len) < 0) {
+        log_error("failed to connect to handler %d: %s", ch->index, strerror(errno));
+        close(ch->fd);
+        ch->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// 書けるだけ書く。書ききれなければ残りは書けるようになってから書く
+static void flush_channel(struct HandlerChannel *ch) {
+    ssize_t n;
+
+    while (ch->fd >= 0 && ch->outpos < ch->out.len) {
+        n = send(ch->fd, ch->out.data + ch->outpos, ch->out.len - ch->outpos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!WOULD_BLOCK(errno)) {
+                fail_channel(ch, strerror(errno));
+            }
+            return;
+        }
+        ch->outpos += n;
+    }
+    ch->out.len = ch->outpos = 0;
+}
+
+// 届いたフレームを待っている接続に渡す。応答はidで探すが、たいていは送った順に返ってくる
+static void parse_replies(struct HandlerChannel *ch) {
+    struct HandlerFrame frame;
+    struct Connection **p, *conn;
+    size_t pos = 0;
+
+    while (ch->inlen - pos >= sizeof frame) {
+        memcpy(&frame, ch->in + pos, sizeof frame);
+        if (frame.len > MAX_HANDLER_REPLY) {
+            fail_channel(ch, "reply too large");
+            return;
+        }
+        if (ch->inlen - pos - sizeof frame < frame.len) {
+            break;
+        }
+        for (p = &ch->calls; *p && (*p)->call_id != frame.id; p = &(*p)->call_next) {
+        }
+        if (*p) {
+            conn = *p;
+            *p = conn->call_next;
+            ch->ncalls--;
+            conn->reply = xmalloc(frame.len + 1);
+            memcpy(conn->reply, ch->in + pos + sizeof frame, frame.len);
+            conn->reply_len = frame.len;
+            call_answered(conn);
+        }
+        pos += sizeof frame + frame.len;
+    }
+    memmove(ch->in, ch->in + pos, ch->inlen - pos);
+    ch->inlen -= pos;
+    // 途中まで届いたフレームが入りきるように広げておく
+    if (ch->inlen >= sizeof frame) {
+        memcpy(&frame, ch->in, sizeof frame);
+        while (ch->incap < sizeof frame + frame.len) {
+            ch->incap *= 2;
+        }
+        ch->in = realloc(ch->in, ch->incap);
+        if (!ch->in) {
+            log_exit("failed to allocate memory");
+        }
+    }
+}
+
+static void read_channel(struct HandlerChannel *ch) {
+    ssize_t n;
+
+    while (ch->fd >= 0) {
+        n = read(ch->fd, ch->in + ch->inlen, ch->incap - ch->inlen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!WOULD_BLOCK(errno)) {
+                fail_channel(ch, strerror(errno));
+            }
+            return;
+        }
+        if (n == 0) {
+            fail_channel(ch, "handler closed the connection");
+            return;
+        }
+        ch->inlen += n;
+        parse_replies(ch);
+    }
+}
+
+static void channel_ready(struct HandlerChannel *ch, int writable) {
+    if (writable) {
+        flush_channel(ch);
+    }
+    read_channel(ch);
+    mark_dirty(ch);
+}
+
+// 待っている呼び出しが一番少ないハンドラを選ぶ。落ちたばかりのハンドラは呼び出しが0なので、
+// そのままでは新しい呼び出しがすべて集まってしまう。他に選べるハンドラがある間は避ける
+static struct HandlerChannel *pick_channel(long long now) {
+    struct HandlerChannel *ch, *best = NULL;
+    int i, failed, best_failed = 0;
+
+    for (i = 0; i < handler_procs; i++) {
+        ch = &channels[i];
+        failed = ch->backoff_until > now;
+        if (!best || failed < best_failed || (failed == best_failed && ch->ncalls < best->ncalls)) {
+            best = ch;
+            best_failed = failed;
+        }
+    }
+    return best;
+}
+
+// 選んだハンドラに繋げなければ次に空いているハンドラを試す。どこにも渡せなければ0を返し、connには502を返させる
+static int handler_call(struct Connection *conn, struct HTTPRequest *req) {
+    struct HandlerChannel *ch;
+    long long now = now_us();
+    int failed;
+
+    __atomic_fetch_add(&my_stats->handler_calls, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        ch = pick_channel(now);
+        if (ch->fd >= 0 || connect_channel(ch) == 0) {
+            break;
+        }
+        // 避けていたハンドラしか残っていなかったのなら諦める
+        failed = ch->backoff_until > now;
+        ch->backoff_until = now + HANDLER_BACKOFF_US;
+        if (failed) {
+            conn->replied = 1;
+            return 0;
+        }
+    }
+    if (++ch->next_id == 0) {
+        ch->next_id = 1;
+    }
+    put_handler_request(&ch->out, req, ch->next_id);
+    conn->call_id = ch->next_id;
+    conn->call_channel = ch;
+    conn->call_next = ch->calls;
+    ch->calls = conn;
+    ch->ncalls++;
+    flush_channel(ch);
+    mark_dirty(ch);
+    return 1;
+}
+
+// 応答を待っている接続が先に解放される時に、待ち行列から外す
+static void cancel_call(struct Connection *conn) {
+    struct HandlerChannel *ch = conn->call_channel;
+    struct Connection **p;
+
+    if (!ch) {
+        return;
+    }
+    for (p = conn->replied ? &answered_calls : &ch->calls; *p && *p != conn; p = &(*p)->call_next) {
+    }
+    if (*p) {
+        *p = conn->call_next;
+        ch->ncalls -= !conn->replied;
+    }
+    conn->call_channel = NULL;
+}
+
+static void call_timed_out(struct Connection *conn) {
+    struct HandlerChannel *ch = conn->call_channel;
+
+    log_error("handler %d did not reply within %d seconds", ch->index, HANDLER_TIMEOUT);
+    cancel_call(conn);
+    conn->call_channel = ch;
+    call_answered(conn);
+}
+
+// REQ_PENDINGで待つ間、ハンドラの応答にだけタイムアウトを掛ける。ファイルを調べている間は掛けない
+static void wait_pending(struct Connection *conn) {
+    if (conn->call_channel && !conn->replied) {
+        timer_start(&conn->timer, TIMEOUT_HANDLER, HANDLER_TIMEOUT);
+    } else {
+        timer_stop(&conn->timer);
+    }
+}
+
+// 応答が届いた接続を取り出す。届いた順に並べ直して返す
+static struct Connection *take_answered_calls(void) {
+    struct Connection *conn, *next, *list = NULL;
+
+    for (conn = answered_calls; conn; conn = next) {
+        next = conn->call_next;
+        conn->call_channel = NULL;
+        conn->call_next = list;
+        list = conn;
+    }
+    answered_calls = NULL;
+    return list;
+}
+
+static struct HotCache *new_hot_cache(size_t budget, int admission, unsigned long *bytes_stat);
+
+static struct ThreadPool *new_thread_pool(int nthreads);
+
+static void pool_complete(int epfd, struct ThreadPool *pool, char *docroot);
+
+// 長く生きるプロセスなのでstat/openの結果をキャッシュできる。
+// ホットキャッシュと圧縮キャッシュの無効化はファイルキャッシュのinotify監視に任せる
+static void setup_caches(void) {
+    if (file_cache_size == 0) {
+        return;
+    }
+    file_cache = new_file_cache(file_cache_size);
+    if (hot_cache_budget > 0) {
+        hot_cache = new_hot_cache(hot_cache_budget, 1, &my_stats->hot_cache_bytes);
+    }
+    if (gzip_cache_budget > 0) {
+        gzip_cache = new_hot_cache(gzip_cache_budget, 0, &my_stats->gzip_cache_bytes);
+    }
+}
+
+// 状態の変わったハンドラへの接続だけ監視をやり直す。書き残しがあればEPOLLOUTも待つ
+static void watch_channels(int epfd) {
+    struct HandlerChannel *ch;
+    struct epoll_event ev;
+    int events, op;
+
+    for (ch = dirty_channels; ch; ch = ch->dirty_next) {
+        ch->dirty = 0;
+        if (ch->fd < 0) {
+            continue;
+        }
+        events = EPOLLIN | (ch->outpos < ch->out.len ? EPOLLOUT : 0);
+        if (ch->events == events) {
+            continue;
+        }
+        op = ch->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        ev.events = events;
+        ev.data.ptr = &ch->source;
+        if (epoll_ctl(epfd, op, ch->fd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+        ch->events = events;
+    }
+    dirty_channels = NULL;
+}
+
+// 1プロセスでノンブロッキングソケットを多重化する。イベントの種類はdata.ptrの先頭のEventSourceで見分ける
+static void epoll_server_main(int server_fd, char *docroot) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    int epfd;
+    int i, n;
+
+    wheel_init();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    }
+
+    set_nonblocking(server_fd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_source;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+
+    setup_caches();
+    if (file_cache) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = file_cache;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, file_cache->inotify_fd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+    }
+
+    // ループを止めないように、キャッシュにないファイルのlstat/openはスレッドに任せる
+    if (io_threads > 0) {
+        new_thread_pool(io_threads);
+        ev.events = EPOLLIN;
+        ev.data.ptr = thread_pool;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, thread_pool->efd, &ev) < 0) {
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        }
+    }
+
+    setup_channels();
+
+    if (workers == 0) {
+        my_stats->pid = getpid();
+    }
+    trap_control_signals();
+
+    for (;;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, wheel.count > 0 || draining ? 1000 : -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log_exit("epoll_wait(2) failed: %s", strerror(errno));
+            }
+            n = 0;
+        }
+        for (i = 0; i < n; i++) {
+            struct EventSource *source = events[i].data.ptr;
+
+            switch (source->type) {
+                case SOURCE_LISTENER:
+                    accept_connections(epfd, server_fd);
+                    break;
+                case SOURCE_INOTIFY:
+                    handle_inotify_events((struct FileCache *) source);
+                    break;
+                case SOURCE_POOL:
+                    pool_complete(epfd, (struct ThreadPool *) source, docroot);
+                    break;
+                case SOURCE_HANDLER:
+                    channel_ready((struct HandlerChannel *) source, events[i].events & EPOLLOUT);
+                    break;
+                default:
+                    handle_connection(epfd, (struct Connection *) source, docroot);
+                    break;
+            }
+        }
+        if (master_signal && handle_control_signal(&server_fd, 1)) {
+            // リスニングソケットは後継のプロセスが同じものを使い続けるので、ここで閉じても接続は失われない
+            epoll_ctl(epfd, EPOLL_CTL_DEL, server_fd, NULL);
+            close(server_fd);
+            begin_drain();
+        }
+        run_timers(free_connection);
+        if (draining) {
+            close_idle_connections(free_connection);
+        }
+        // 応答の届いた接続は、このバッチのイベントとタイマーを扱い終えてから再開する
+        if (channels) {
+            struct Connection *conn, *next;
+
+            while (answered_calls) {
+                for (conn = take_answered_calls(); conn; conn = next) {
+                    next = conn->call_next;
+                    handle_connection(epfd, conn, docroot);
+                }
+            }
+            watch_channels(epfd);
+        }
+        if (draining && drained()) {
+            finish_draining();
+        }
+    }
+}
+
+// 接続が殺到しても既存の接続を待たせすぎないよう、1回にACCEPT_BATCH個まで受け付ける。
+// リスニングソケットはレベルトリガで見ているので、残りは次のepoll_wait(2)で通知される
+static void accept_connections(int epfd, int server_fd) {
+    int i;
+
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        struct epoll_event ev;
+        struct Connection *conn;
+        int sock;
+
+        sock = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!WOULD_BLOCK(errno)) {
+                log_error("accept4(2) failed: %s", strerror(errno));
+            }
+            return;
+        }
+        __atomic_fetch_add(&my_stats->accepted, 1, __ATOMIC_RELAXED);
+
+        conn = new_connection(sock);
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            log_error("epoll_ctl(2) failed: %s", strerror(errno));
+            free_connection(conn);
+            continue;
+        }
+        conn->events = EPOLLIN;
+        wait_with_timeout(conn);
+    }
+}
+
+static int fill_connection(struct Connection *conn);
+
+static int send_response(struct Connection *conn);
+
+static int process_request(struct Connection *conn, char *docroot);
+
+static int continue_upload(struct Connection *conn, char *docroot);
+
+static void reset_response(struct Connection *conn);
+
+// conn->lookupのファイルを調べ始める。あとで完了を知らせるなら1、その場で調べ終えたなら0を返す
+typedef int (*lookup_starter)(struct Connection *conn, void *arg);
+
+static int process_request_async(struct Connection *conn, char *docroot, lookup_starter start, void *arg);
+
+static int pool_submit(struct Connection *conn, void *arg);
+
+static int watch_connection(int epfd, struct Connection *conn, int events) {
+    struct epoll_event ev;
+
+    if (conn->events == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+        log_error("epoll_ctl(2) failed: %s", strerror(errno));
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+// inbufにパイプライン化されたリクエストが残っていれば、読み込みを待たずに続けて処理する
+static void handle_connection(int epfd, struct Connection *conn, char *docroot) {
+    int n;
+
+    // ファイル操作やハンドラの完了を待っている間に届いたイベントは、完了後にまとめて扱う
+    if (conn->task || conn->call_channel) {
+        return;
+    }
+    if (conn->state == CONN_READING && !conn->eof) {
+        for (;;) {
+            // バッファが一杯になったら先に処理する。アップロードのボディまでバッファに溜め込まないように、
+            // 残りはレベルトリガのEPOLLINでもう一度知らされてから読む
+            n = fill_connection(conn);
+            if (n > 0 && conn->inlen < conn->incap) {
+                continue;
+            }
+            if (n > 0) {
+                break;
+            }
+            if (n == 0) {
+                conn->eof = 1;
+            } else if (!WOULD_BLOCK(errno)) {
+                free_connection(conn);
+                return;
+            }
+            break;
+        }
+    }
+
+    for (;;) {
+        if (conn->state == CONN_UPLOADING) {
+            n = continue_upload(conn, docroot);
+            if (n < 0) {
+                free_connection(conn);
+                return;
+            }
+            if (n == REQ_UPLOADING) {
+                if (watch_connection(epfd, conn, EPOLLIN) < 0) {
+                    free_connection(conn);
+                } else {
+                    wait_with_timeout(conn);
+                }
+                return;
+            }
+            timer_stop(&conn->timer);
+            conn->state = CONN_WRITING;
+        }
+        if (conn->state == CONN_READING) {
+            n = thread_pool || channels ? process_request_async(conn, docroot, thread_pool ? pool_submit : NULL, thread_pool)
+                                        : process_request(conn, docroot);
+            if (n == REQ_UPLOADING) {
+                continue;
+            }
+            if (n == REQ_PENDING) {
+                wait_pending(conn);
+                watch_connection(epfd, conn, 0);
+                return;
+            }
+            if (n == REQ_INCOMPLETE) {
+                if (conn->eof || watch_connection(epfd, conn, EPOLLIN) < 0) {
+                    free_connection(conn);
+                } else {
+                    wait_with_timeout(conn);
+                }
+                return;
+            }
+            timer_stop(&conn->timer);
+            conn->state = CONN_WRITING;
+        }
+
+        n = send_response(conn);
+        if (n < 0) {
+            free_connection(conn);
+            return;
+        }
+        if (n == 0) {
+            // 送信バッファが一杯なので書き込み可能になるまで待つ
+            if (watch_connection(epfd, conn, EPOLLOUT) < 0) {
+                free_connection(conn);
+            }
+            return;
+        }
+        finish_response(conn);
+        if (!conn->keep_alive) {
+            free_connection(conn);
+            return;
+        }
+        reset_response(conn);
+    }
+}
+
+static struct Connection *new_connection(int sock) {
+    struct Connection *conn;
+    int one = 1;
+
+    // 応答の切れ目はMSG_MOREで示しているので、最後のセグメントをNagleアルゴリズムで遅らせる必要はない
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    conn = xmalloc(sizeof(struct Connection));
+    conn->source.type = SOURCE_CONNECTION;
+    conn->sock = sock;
+    conn->state = CONN_READING;
+    conn->events = 0;
+    conn->eof = 0;
+    conn->keep_alive = 0;
+    conn->served = 0;
+    conn->timer.kind = TIMEOUT_NONE;
+    conn->incap = INPUT_BUF_SIZE;
+    conn->inbuf = xmalloc(conn->incap);
+    conn->inlen = 0;
+    conn->scan_pos = 0;
+    conn->header_len = 0;
+    conn->req = NULL;
+    conn->arena.head = NULL;
+    conn->out.cap = OUTPUT_BUF_SIZE;
+    conn->out.data = xmalloc(conn->out.cap);
+    conn->out.len = 0;
+    conn->outpos = 0;
+    conn->body_fd = -1;
+    conn->body_info = NULL;
+    conn->body_content = NULL;
+    conn->segments = NULL;
+    conn->nsegments = 0;
+    conn->segment_index = 0;
+    conn->parts.data = NULL;
+    conn->parts.len = 0;
+    conn->parts.cap = 0;
+    conn->body_mode = BODY_SENDFILE;
+    conn->body_offset = 0;
+    conn->body_remain = 0;
+    conn->pipefd[0] = -1;
+    conn->pipefd[1] = -1;
+    conn->piped = 0;
+    conn->blockbuf = NULL;
+    conn->blocklen = 0;
+    conn->blockpos = 0;
+    conn->uring_op = UOP_NONE;
+    conn->pending = NULL;
+    conn->lookup = NULL;
+    conn->listing = NULL;
+    conn->stx = NULL;
+    conn->task = NULL;
+    conn->t_request = 0;
+    conn->t_start = 0;
+    conn->t_lookup = 0;
+    conn->t_response = 0;
+    conn->lookup_us = 0;
+    conn->status = 0;
+    conn->response_bytes = 0;
+    conn->peer[0] = '\0';
+    conn->upload_fd = -1;
+    conn->upload_tmp = NULL;
+    conn->upload_path = NULL;
+    conn->upload_remain = 0;
+    conn->upload_size = 0;
+    conn->upload_status = 0;
+    conn->call_channel = NULL;
+    conn->call_id = 0;
+    conn->call_next = NULL;
+    conn->replied = 0;
+    conn->reply = NULL;
+    conn->reply_len = 0;
+    live_connections++;
+    return conn;
+}
+
+// 送り終えたレスポンスを捨てて、同じ接続で次のリクエストを受けられる状態に戻す
+static void reset_response(struct Connection *conn) {
+    conn->out.len = 0;
+    conn->outpos = 0;
+    if (conn->body_info) {
+        free_fileinfo(conn->body_info);
+        conn->body_info = NULL;
+    }
+    if (conn->body_content) {
+        release_content(conn->body_content);
+        conn->body_content = NULL;
+    }
+    free(conn->segments);
+    conn->segments = NULL;
+    conn->nsegments = 0;
+    conn->segment_index = 0;
+    conn->parts.len = 0;
+    conn->body_fd = -1;
+    conn->body_offset = 0;
+    conn->body_remain = 0;
+    conn->blocklen = 0;
+    conn->blockpos = 0;
+    conn->state = CONN_READING;
+}
+
+static void free_connection(struct Connection *conn) {
+    live_connections--;
+    timer_stop(&conn->timer);
+    cancel_call(conn);
+    free(conn->reply);
+    if (conn->body_info) {
+        free_fileinfo(conn->body_info);
+    }
+    if (conn->body_content) {
+        release_content(conn->body_content);
+    }
+    if (conn->lookup) {
+        free_fileinfo(conn->lookup);
+    }
+    if (conn->listing) {
+        free_fileinfo(conn->listing);
+    }
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    // 受け取りきらずに切れたアップロードの一時ファイルは残さない
+    if (conn->upload_fd >= 0) {
+        close(conn->upload_fd);
+        unlink(conn->upload_tmp);
+    }
+    free(conn->upload_tmp);
+    free(conn->upload_path);
+    close(conn->sock);
+    arena_free(&conn->arena);
+    free(conn->inbuf);
+    free(conn->out.data);
+    free(conn->parts.data);
+    free(conn->segments);
+    free(conn->blockbuf);
+    free(conn->stx);
+    free(conn);
+}
+
+static void rebase_request(struct HTTPRequest *req, char *old, char *new);
+
+// 解析済みのリクエストはinbuf内を指しているので、バッファを移したらポインタも付け替える
+static void grow_input(struct Connection *conn, size_t need) {
+    size_t cap = conn->incap;
+    char *buf;
+
+    while (cap < need) {
+        cap *= 2;
+    }
+    buf = xmalloc(cap);
+    memcpy(buf, conn->inbuf, conn->inlen);
+    if (conn->req) {
+        rebase_request(conn->req, conn->inbuf, buf);
+    }
+    free(conn->inbuf);
+    conn->inbuf = buf;
+    conn->incap = cap;
+}
+
+// ソケットから読めるだけ読んでinbufの末尾に追加する。戻り値はread(2)と同じ
+static int fill_connection(struct Connection *conn) {
+    ssize_t n;
+
+    if (conn->inlen == conn->incap) {
+        if (conn->incap >= MAX_REQUEST_HEADER_LENGTH + MAX_REQUEST_BODY_LENGTH) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        grow_input(conn, conn->incap * 2);
+    }
+
+    do {
+        n = read(conn->sock, conn->inbuf + conn->inlen, conn->incap - conn->inlen);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        if (conn->inlen == 0) {
+            conn->t_request = now_us();
+        }
+        conn->inlen += n;
+    }
+    return (int) n;
+}
+
+// ページキャッシュからソケットへ直接送る。対応していないファイルならsplice(2)に切り替える
+static int send_body_sendfile(struct Connection *conn) {
+    ssize_t n;
+
+    while (conn->body_remain > 0) {
+        n = sendfile(conn->sock, conn->body_fd, &conn->body_offset, conn->body_remain);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (WOULD_BLOCK(errno)) {
+                return 0;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                conn->body_mode = BODY_SPLICE;
+                return 1;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            log_error("failed to send response body: unexpected EOF");
+            return -1;
+        }
+        conn->body_remain -= n;
+    }
+    return 1;
+}
+
+// ファイル→パイプ→ソケットとカーネル内で移す。パイプに残った分はpipedで覚えておく
+static int send_body_splice(struct Connection *conn) {
+    ssize_t n;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("pipe2(2) failed: %s", strerror(errno));
+        conn->body_mode = BODY_COPY;
+        return 1;
+    }
+
+    while (conn->piped > 0 || conn->body_remain > 0) {
+        if (conn->piped == 0) {
+            n = splice(conn->body_fd, &conn->body_offset, conn->pipefd[1], NULL,
+                       conn->body_remain < SEND_BUF_SIZE ? (size_t) conn->body_remain : SEND_BUF_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL) {
+                    conn->body_mode = BODY_COPY;
+                    return 1;
+                }
+                return -1;
+            }
+            if (n == 0) {
+                log_error("failed to send response body: unexpected EOF");
+                return -1;
+            }
+            conn->piped = n;
+            conn->body_remain -= n;
+        }
+
+        n = splice(conn->pipefd[0], NULL, conn->sock, NULL, conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        conn->piped -= n;
+    }
+    return 1;
+}
+
+static int send_body_copy(struct Connection *conn) {
+    ssize_t n;
+
+    while (conn->blockpos < conn->blocklen || conn->body_remain > 0) {
+        if (conn->blockpos == conn->blocklen) {
+            size_t len = conn->body_remain < SEND_BUF_SIZE ? (size_t) conn->body_remain : SEND_BUF_SIZE;
+
+            if (!conn->blockbuf) {
+                conn->blockbuf = xmalloc(SEND_BUF_SIZE);
+            }
+            n = pread(conn->body_fd, conn->blockbuf, len, conn->body_offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                log_error("failed to read response body: %s", n < 0 ? strerror(errno) : "unexpected EOF");
+                return -1;
+            }
+            conn->blocklen = n;
+            conn->blockpos = 0;
+            conn->body_offset += n;
+            conn->body_remain -= n;
+        }
+
+        n = write(conn->sock, conn->blockbuf + conn->blockpos, conn->blocklen - conn->blockpos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        conn->blockpos += n;
+    }
+    return 1;
+}
+
+// ヘッダとメモリ上のボディをwritev(2)でまとめて送る
+static int send_content(struct Connection *conn) {
+    struct iovec iov[2];
+    size_t head;
+    ssize_t n;
+
+    while (conn->outpos < conn->out.len || conn->body_remain > 0) {
+        head = conn->out.len - conn->outpos;
+        iov[0].iov_base = conn->out.data + conn->outpos;
+        iov[0].iov_len = head;
+        iov[1].iov_base = conn->body_content->data + conn->body_offset;
+        iov[1].iov_len = conn->body_remain;
+        n = writev(conn->sock, iov, 2);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        if ((size_t) n <= head) {
+            conn->outpos += n;
+        } else {
+            conn->outpos = conn->out.len;
+            conn->body_offset += n - head;
+            conn->body_remain -= n - head;
+        }
+    }
+    return 1;
+}
+
+// body_offsetからbody_remainバイトをファイルから送る
+static int send_file_body(struct Connection *conn) {
+    int result;
+
+    if (conn->body_mode == BODY_SENDFILE) {
+        result = send_body_sendfile(conn);
+        if (result != 1 || conn->body_mode == BODY_SENDFILE) {
+            return result;
+        }
+    }
+    if (conn->body_mode == BODY_SPLICE) {
+        result = send_body_splice(conn);
+        if (result != 1 || conn->body_mode == BODY_SPLICE) {
+            return result;
+        }
+    }
+    return send_body_copy(conn);
+}
+
+// 複数範囲のボディを順に送る。各セグメントを始める時にbody_offset/body_remainをその範囲に合わせる
+static int send_segments(struct Connection *conn) {
+    struct BodySegment *seg;
+    ssize_t n;
+    int result;
+
+    while (conn->segment_index < conn->nsegments) {
+        seg = &conn->segments[conn->segment_index];
+        if (seg->in_memory) {
+            while (conn->body_remain > 0) {
+                n = send(conn->sock, conn->parts.data + conn->body_offset, conn->body_remain,
+                         MSG_NOSIGNAL | (conn->segment_index + 1 < conn->nsegments ? MSG_MORE : 0));
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return WOULD_BLOCK(errno) ? 0 : -1;
+                }
+                conn->body_offset += n;
+                conn->body_remain -= n;
+            }
+        } else {
+            result = send_file_body(conn);
+            if (result != 1) {
+                return result;
+            }
+        }
+        if (++conn->segment_index < conn->nsegments) {
+            conn->body_offset = conn->segments[conn->segment_index].offset;
+            conn->body_remain = conn->segments[conn->segment_index].length;
+        }
+    }
+    return 1;
+}
+
+// ヘッダを送り切ってからボディを送る。1なら送信完了、0ならEAGAIN、-1ならエラー
+static int send_response(struct Connection *conn) {
+    ssize_t n;
+
+    if (conn->body_content) {
+        return send_content(conn);
+    }
+
+    // ボディが続く場合はMSG_MOREでヘッダだけの小さなセグメントを出さないようにする
+    while (conn->outpos < conn->out.len) {
+        n = send(conn->sock, conn->out.data + conn->outpos, conn->out.len - conn->outpos,
+                 MSG_NOSIGNAL | (conn->body_remain > 0 || conn->nsegments > 0 ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        conn->outpos += n;
+    }
+
+    if (conn->nsegments > 0) {
+        return send_segments(conn);
+    }
+    if (conn->body_fd < 0) {
+        return 1;
+    }
+    return send_file_body(conn);
+}
+
+static int read_request(struct Connection *conn, struct HTTPRequest **reqp);
+
+static void consume_request(struct Connection *conn);
+
+static void respond_to(struct HTTPRequest *req, struct Connection *conn, char *docroot);
+
+static void bad_request(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void not_implemented(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void free_request(struct HTTPRequest *req);
+
+static void log_access(struct Connection *conn, struct HTTPRequest *req);
+
+// read_request()の結果に応じてレスポンスをconnに用意する
+static void answer_request(struct Connection *conn, struct HTTPRequest *req, int result, char *docroot) {
+    long long since = now_us();
+
+    if (result == REQ_BAD) {
+        conn->keep_alive = 0;
+        bad_request(NULL, &conn->out);
+    } else if (result == REQ_UNSUPPORTED) {
+        conn->keep_alive = 0;
+        not_implemented(NULL, &conn->out);
+    } else {
+        // 終了に向かっている間はConnection: closeを返して接続を閉じてもらう
+        if (draining) {
+            req->keep_alive = 0;
+        }
+        conn->keep_alive = req->keep_alive;
+        respond_to(req, conn, docroot);
+    }
+    response_ready(conn, since);
+    log_access(conn, result == REQ_OK ? req : NULL);
+    if (result == REQ_OK) {
+        consume_request(conn);
+    }
+    conn->served++;
+}
+
+static int start_upload(struct Connection *conn, struct HTTPRequest *req, char *docroot);
+
+// inbufに溜まったバイト列からリクエストを1つ取り出し、レスポンスをconnに用意する。
+// アップロードのボディがまだ届いていなければREQ_UPLOADINGを返すので、continue_upload()で受け取る
+static int process_request(struct Connection *conn, char *docroot) {
+    struct HTTPRequest *req;
+    int result;
+
+    result = read_request(conn, &req);
+    if (result != REQ_INCOMPLETE) {
+        request_parsed(conn);
+        if (result == REQ_OK && req->streamed && start_upload(conn, req, docroot)) {
+            return REQ_UPLOADING;
+        }
+        answer_request(conn, req, result, docroot);
+    }
+    return result;
+}
+
+// PUT/POSTをファイルの書き込みとして受け付けるか
+static int is_upload_request(struct HTTPRequest *req) {
+    return uploads_enabled && !is_handler_request(req) && (strcmp(req->method, "PUT") == 0 || strcmp(req->method, "POST") == 0);
+}
+
+// 既にあるディレクトリの下のファイルにだけ書ける。"."で始まる要素は".."や一時ファイルと区別できないので拒む
+static int upload_path_ok(char *path) {
+    char *p;
+
+    if (path[0] != '/' || strchr(path, '?')) {
+        return 0;
+    }
+    for (p = path; p; p = strchr(p + 1, '/')) {
+        if (p[1] == '\0' || p[1] == '.' || p[1] == '/') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void fail_upload(struct Connection *conn) {
+    close(conn->upload_fd);
+    unlink(conn->upload_tmp);
+    conn->upload_fd = -1;
+    conn->upload_status = 500;
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+        conn->pipefd[0] = conn->pipefd[1] = -1;
+        conn->piped = 0;
+    }
+}
+
+static char *build_fspath(char *docroot, char *urlpath);
+
+static int open_upload(struct Connection *conn, char *docroot, char *urlpath) {
+    struct stat st;
+    char *slash;
+    int err;
+
+    conn->upload_path = build_fspath(docroot, urlpath);
+    if (lstat(conn->upload_path, &st) == 0) {
+        if (!S_ISREG(st.st_mode)) {
+            return 409;
+        }
+        conn->upload_status = 204;
+    }
+    slash = strrchr(conn->upload_path, '/');
+    conn->upload_tmp = xmalloc(slash - conn->upload_path + sizeof "/.upload.XXXXXX");
+    sprintf(conn->upload_tmp, "%.*s/.upload.XXXXXX", (int) (slash - conn->upload_path), conn->upload_path);
+    conn->upload_fd = mkostemp(conn->upload_tmp, O_CLOEXEC);
+    if (conn->upload_fd < 0) {
+        err = errno;
+        log_error("cannot create %s: %s", conn->upload_tmp, strerror(err));
+        return err == ENOENT || err == ENOTDIR ? 409 : 500;
+    }
+    fchmod(conn->upload_fd, 0644);
+    return conn->upload_status;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static char *lookup_header_field_value(struct HTTPRequest *req, char *name);
+
+// アップロードのボディをディレクトリ内の一時ファイルに書き始める。最後にrename(2)で置き換えるので、
+// 書きかけのファイルが見えることはない。ボディの残りをこれから受け取るなら1を返す
+static int start_upload(struct Connection *conn, struct HTTPRequest *req, char *docroot) {
+    char *expect;
+    size_t take;
+
+    conn->upload_status = 201;
+    conn->upload_size = 0;
+    if (!upload_path_ok(req->path)) {
+        conn->upload_status = 403;
+    } else {
+        conn->upload_status = open_upload(conn, docroot, req->path);
+    }
+    if (conn->upload_fd < 0) {
+        // ボディは受け取らずに応答して接続を閉じる
+        req->keep_alive = 0;
+        return 0;
+    }
+
+    // ヘッダと一緒に届いた分を書いてinbufから取り除く。後ろにある次のリクエストは残す
+    take = conn->inlen - conn->header_len;
+    if (take > (size_t) req->length) {
+        take = req->length;
+    }
+    if (write_all(conn->upload_fd, conn->inbuf + conn->header_len, take) < 0) {
+        log_error("failed to write %s: %s", conn->upload_tmp, strerror(errno));
+        fail_upload(conn);
+        req->keep_alive = 0;
+        return 0;
+    }
+    memmove(conn->inbuf + conn->header_len, conn->inbuf + conn->header_len + take,
+            conn->inlen - conn->header_len - take);
+    conn->inlen -= take;
+    conn->upload_size = take;
+    conn->upload_remain = req->length - take;
+    if (conn->upload_remain == 0) {
+        return 0;
+    }
+
+    // 送れなくても、クライアントは少し待てばボディを送ってくる
+    expect = lookup_header_field_value(req, "Expect");
+    if (take == 0 && expect && strcasecmp(expect, "100-continue") == 0 && req->protocol_minor_version >= 1) {
+        send(conn->sock, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    conn->state = CONN_UPLOADING;
+    return 1;
+}
+
+// ソケット→パイプ→ファイルとカーネル内でボディを移す。パイプにはSEND_BUF_SIZEまでしか入れないので、
+// 使うメモリはボディの大きさによらない。受け取り終えたか書き込みに失敗したら1、
+// ソケットが空なら0、クライアントが切断したら-1を返す
+static int pump_upload(struct Connection *conn) {
+    ssize_t n;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+        log_error("pipe2(2) failed: %s", strerror(errno));
+        fail_upload(conn);
+        return 1;
+    }
+    for (;;) {
+        while (conn->piped > 0) {
+            n = splice(conn->pipefd[0], NULL, conn->upload_fd, NULL, conn->piped, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                log_error("failed to write %s: %s", conn->upload_tmp, n < 0 ? strerror(errno) : "short write");
+                fail_upload(conn);
+                return 1;
+            }
+            conn->piped -= n;
+            conn->upload_size += n;
+        }
+        if (conn->upload_remain == 0) {
+            return 1;
+        }
+        n = splice(conn->sock, NULL, conn->pipefd[1], NULL,
+                   conn->upload_remain < SEND_BUF_SIZE ? (size_t) conn->upload_remain : SEND_BUF_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return WOULD_BLOCK(errno) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        conn->piped = n;
+        conn->upload_remain -= n;
+    }
+}
+
+// ボディを受け取り終えたリクエストに応答する
+static void upload_received(struct Connection *conn, char *docroot) {
+    conn->state = CONN_READING;
+    answer_request(conn, conn->req, REQ_OK, docroot);
+}
+
+// ボディを受け取れるだけ受け取る。受け取り終えたらレスポンスを用意してREQ_OK、
+// まだ残っていればREQ_UPLOADING、クライアントが切断したら-1を返す
+static int continue_upload(struct Connection *conn, char *docroot) {
+    int n;
+
+    n = pump_upload(conn);
+    if (n <= 0) {
+        return n == 0 ? REQ_UPLOADING : -1;
+    }
+    upload_received(conn, docroot);
+    return REQ_OK;
+}
+
+// forkモードのブロッキングソケットが締め切り(us)までに読めるようになれば1、タイムアウトしたら0を返す
+static int wait_readable(int sock, long long deadline) {
+    struct pollfd pfd;
+    long long left;
+    int n;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    for (;;) {
+        left = deadline - now_us();
+        if (left <= 0) {
+            return 0;
+        }
+        n = poll(&pfd, 1, (int) ((left + 999) / 1000));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n != 0;
+    }
+}
+
+// キープアライブ中はクライアントが閉じるか、次のリクエストが来ないままタイムアウトするまで繰り返す。
+// 1プロセスで1接続しか扱わないのでタイマーホイールは使わず、読む前にpoll(2)で締め切りまで待つ
+static void service(struct Connection *conn, char *docroot) {
+    struct timeval tv;
+    long long deadline = 0;
+    int result, n, kind, waiting = TIMEOUT_NONE;
+
+    for (;;) {
+        while ((result = process_request(conn, docroot)) == REQ_INCOMPLETE) {
+            kind = read_timeout(conn);
+            if (kind != TIMEOUT_HEADER || waiting != TIMEOUT_HEADER) {
+                deadline = now_us() + timeout_seconds(kind) * 1000000LL;
+            }
+            waiting = kind;
+            if (!wait_readable(conn->sock, deadline)) {
+                count_timeout(kind);
+                return;
+            }
+            n = fill_connection(conn);
+            // リクエストの合間に閉じたりリセットしたりするのはクライアントの普通の振る舞いなので黙って終える
+            if ((n == 0 || (n < 0 && errno == ECONNRESET)) && conn->inlen == 0) {
+                return;
+            }
+            if (n < 0) {
+                log_exit("failed to read request: %s", strerror(errno));
+            }
+            if (n == 0) {
+                log_exit("unexpected EOF while reading request");
+            }
+        }
+        waiting = TIMEOUT_NONE;
+        // ソケットはブロッキングなので、ボディを受け取り終えるまで戻らない。
+        // 何も届かないまま--body-timeoutが過ぎるとSO_RCVTIMEOで受信がEAGAINになり、REQ_UPLOADINGが返る
+        if (result == REQ_UPLOADING) {
+            tv.tv_sec = body_timeout;
+            tv.tv_usec = 0;
+            setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        }
+        while (result == REQ_UPLOADING) {
+            result = continue_upload(conn, docroot);
+            if (result < 0) {
+                free_connection(conn);
+                log_exit("connection closed while receiving request body");
+            }
+            if (result == REQ_UPLOADING) {
+                count_timeout(TIMEOUT_BODY);
+                return;
+            }
+        }
+
+        if (send_response(conn) < 0) {
+            log_exit("failed to write to socket: %s", strerror(errno));
+        }
+        finish_response(conn);
+        if (!conn->keep_alive) {
+            return;
+        }
+        reset_response(conn);
+    }
+}
+
+static struct FileInfo *file_cache_lookup(struct FileCache *cache, char *urlpath);
+
+static void file_cache_insert(struct FileCache *cache, char *urlpath, struct FileInfo *info);
+
+static struct FileInfo *new_fileinfo(char *docroot, char *urlpath);
+
+static void set_fileinfo_stat(struct FileInfo *info, unsigned long ino, long size, time_t sec, long nsec);
+
+static int not_modified(struct HTTPRequest *req, struct FileInfo *info);
+
+// --stats-pathで指定したパスへのGET/HEADなら1を返す。クエリ文字列は見ない
+static int is_stats_request(struct HTTPRequest *req) {
+    size_t len;
+
+    if (!stats_path || (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0)) {
+        return 0;
+    }
+    len = strlen(stats_path);
+    return strncmp(req->path, stats_path, len) == 0 && (req->path[len] == '\0' || req->path[len] == '?');
+}
+
+// GET/HEADで、ファイルキャッシュにもないパスなら1を返す。キャッシュにあればconn->lookupに入れておく
+static int needs_lookup(struct Connection *conn, struct HTTPRequest *req) {
+    struct FileInfo *info;
+
+    if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0) {
+        return 0;
+    }
+    if (is_stats_request(req)) {
+        return 0;
+    }
+    if (!file_cache) {
+        return 1;
+    }
+    info = file_cache_lookup(file_cache, req->path);
+    if (info) {
+        __atomic_fetch_add(&my_stats->file_cache_hits, 1, __ATOMIC_RELAXED);
+        info->refcount++;
+        conn->lookup = info;
+        return 0;
+    }
+    __atomic_fetch_add(&my_stats->file_cache_misses, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// ボディを送る必要があり、304にもならない時だけファイルを開く
+static int lookup_needs_open(struct HTTPRequest *req, struct FileInfo *info) {
+    return info->ok && strcmp(req->method, "GET") == 0 && not_modified(req, info) < 0;
+}
+
+static void lookup_done(struct Connection *conn) {
+    record_latency(STAGE_LOOKUP, now_us() - conn->t_lookup);
+    if (file_cache && conn->lookup->ok) {
+        file_cache_insert(file_cache, conn->pending->path, conn->lookup);
+    }
+}
+
+// process_request()と同じだが、キャッシュにないファイルはstart()で調べ始めてREQ_PENDINGを返す。
+// ハンドラに渡したリクエストも応答が届くまでREQ_PENDINGになる。startがNULLならファイルはその場で調べる。
+// 調べ終わったらもう一度呼ぶと、保留していたリクエストに応答する
+static int process_request_async(struct Connection *conn, char *docroot, lookup_starter start, void *arg) {
+    struct HTTPRequest *req;
+    int result;
+
+    if (conn->pending) {
+        req = conn->pending;
+        conn->pending = NULL;
+        result = REQ_OK;
+    } else {
+        result = read_request(conn, &req);
+        if (result == REQ_INCOMPLETE) {
+            return result;
+        }
+        request_parsed(conn);
+        if (result == REQ_OK && req->streamed && start_upload(conn, req, docroot)) {
+            return REQ_UPLOADING;
+        }
+        if (result == REQ_OK && is_handler_request(req)) {
+            conn->pending = req;
+            if (handler_call(conn, req)) {
+                return REQ_PENDING;
+            }
+            conn->pending = NULL;
+        }
+        conn->t_lookup = now_us();
+        if (result == REQ_OK && start && !is_handler_request(req) && needs_lookup(conn, req)) {
+            conn->lookup = new_fileinfo(docroot, req->path);
+            conn->pending = req;
+            if (start(conn, arg)) {
+                return REQ_PENDING;
+            }
+            conn->pending = NULL;
+        } else if (conn->lookup) {
+            record_latency(STAGE_LOOKUP, now_us() - conn->t_lookup);
+        }
+    }
+    answer_request(conn, req, result, docroot);
+    return result;
+}
+
+static long elapsed_us(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int listing_matches(struct Listing *l, struct stat *st);
+
+static struct FileInfo *render_listing(char *dirpath, char *urlpath, struct stat *dirst);
+
+// index.htmlがなかったディレクトリの一覧を、キャッシュにあったものが古ければ描画し直す
+static void run_listing_task(struct FileTask *task) {
+    if (!task->dirpath || stat(task->dirpath, &task->dirst) < 0 || !S_ISDIR(task->dirst.st_mode)) {
+        return;
+    }
+    if (task->known.info && listing_matches(&task->known, &task->dirst)) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &task->rendered);
+    task->listing = render_listing(task->dirpath, task->req->path, &task->dirst);
+}
+
+// スレッドで動くのでinfoとreqしか触らない。ボディを送るならファイルを開き、先頭をページキャッシュに読み込んでおく
+static void run_file_task(struct FileTask *task) {
+    struct FileInfo *info = task->info;
+    struct stat st;
+
+    if (lstat(info->path, &st) < 0) {
+        run_listing_task(task);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        info->is_dir = S_ISDIR(st.st_mode);
+        if (!info->is_dir) {
+            run_listing_task(task);
+        }
+        return;
+    }
+    set_fileinfo_stat(info, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    if (!lookup_needs_open(task->req, info)) {
+        return;
+    }
+    info->fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (info->fd >= 0) {
+        readahead(info->fd, 0, info->size < TASK_READAHEAD ? (size_t) info->size : TASK_READAHEAD);
+    }
+}
+
+static struct FileTask *queue_pop(struct TaskQueue *queue) {
+    struct FileTask *task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        task = queue->items[queue->head];
+        queue->head = (queue->head + 1) % TASK_QUEUE_SIZE;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+static int queue_push(struct TaskQueue *queue, struct FileTask *task) {
+    int pushed = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < TASK_QUEUE_SIZE) {
+        queue->items[(queue->head + queue->count) % TASK_QUEUE_SIZE] = task;
+        queue->count++;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return pushed;
+}
+
+// 自分のキューが空なら隣から順に他のスレッドのキューを見て取ってくる
+static struct FileTask *pool_take(struct ThreadPool *pool, int self) {
+    struct FileTask *task;
+    unsigned long depth;
+    int i;
+
+    for (i = 0; i < pool->nthreads; i++) {
+        task = queue_pop(&pool->queues[(self + i) % pool->nthreads]);
+        if (task) {
+            if (i > 0) {
+                __atomic_fetch_add(&my_stats->pool_steals, 1, __ATOMIC_RELAXED);
+            }
+            depth = __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&my_stats->pool_queue_depth, depth, __ATOMIC_RELAXED);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void record_task_latency(struct FileTask *task, struct timespec *start, struct timespec *end) {
+    unsigned long run = elapsed_us(start, end);
+    unsigned long max = __atomic_load_n(&my_stats->pool_max_run_us, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&my_stats->pool_tasks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_stats->pool_wait_us, elapsed_us(&task->queued, start), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_stats->pool_run_us, run, __ATOMIC_RELAXED);
+    while (run > max && !__atomic_compare_exchange_n(&my_stats->pool_max_run_us, &max, run, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+static void *pool_thread_main(void *arg) {
+    struct ThreadPool *pool = thread_pool;
+    int self = (int) (long) arg;
+    struct FileTask *task, *top;
+    struct timespec start, end;
+    uint64_t one = 1;
+
+    for (;;) {
+        task = pool_take(pool, self);
+        if (!task) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_file_task(task);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        record_task_latency(task, &start, &end);
+
+        top = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+        do {
+            task->next = top;
+        } while (!__atomic_compare_exchange_n(&pool->done, &top, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (write(pool->efd, &one, sizeof one) < 0) {
+            log_error("failed to write eventfd: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+// シグナルはネットワークのループのスレッドだけが受け取るようにしてからスレッドを作る
+static struct ThreadPool *new_thread_pool(int nthreads) {
+    struct ThreadPool *pool;
+    pthread_t thread;
+    sigset_t all, saved;
+    int i, err;
+
+    pool = xmalloc(sizeof(struct ThreadPool));
+    pool->source.type = SOURCE_POOL;
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->efd < 0) {
+        log_exit("eventfd(2) failed: %s", strerror(errno));
+    }
+    pool->nthreads = nthreads;
+    pool->queues = xmalloc(sizeof(struct TaskQueue) * nthreads);
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].head = 0;
+        pool->queues[i].count = 0;
+    }
+    pool->next_queue = 0;
+    pool->pending = 0;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->done = NULL;
+    thread_pool = pool;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (i = 0; i < nthreads; i++) {
+        err = pthread_create(&thread, NULL, pool_thread_main, (void *) (long) i);
+        if (err != 0) {
+            log_exit("pthread_create failed: %s", strerror(err));
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return pool;
+}
+
+static struct Listing *listing_slot(char *path);
+
+static void listing_store(struct Listing *l, char *path, struct stat *st, struct timespec *rendered,
+                          struct FileInfo *info);
+
+// "/"で終わるパスなら、index.htmlがなかった時に備えてディレクトリとキャッシュにある一覧の状態を渡しておく
+static void prepare_listing_task(struct FileTask *task) {
+    struct FileInfo *info = task->info;
+    struct Listing *l;
+
+    task->dirpath = NULL;
+    task->known.info = NULL;
+    task->listing = NULL;
+    task->dirst.st_mode = 0;
+    if (!autoindex || task->req->path[strlen(task->req->path) - 1] != '/') {
+        return;
+    }
+    task->dirpath = xmalloc(strlen(info->path) - strlen(INDEX_FILE) + 1);
+    sprintf(task->dirpath, "%.*s", (int) (strlen(info->path) - strlen(INDEX_FILE)), info->path);
+    l = listing_slot(task->dirpath);
+    if (l->info && strcmp(l->path, task->dirpath) == 0) {
+        task->known = *l;
+    }
+}
+
+// スレッドが描画した一覧をキャッシュに入れ、respond_listing()で使えるようにconnに渡す
+static void listing_done(struct Connection *conn, struct FileTask *task) {
+    struct Listing *l;
+
+    if (!S_ISDIR(task->dirst.st_mode)) {
+        free(task->dirpath);
+        return;
+    }
+    l = listing_slot(task->dirpath);
+    if (task->listing) {
+        listing_store(l, task->dirpath, &task->dirst, &task->rendered, task->listing);
+        conn->listing = task->listing;
+        return;
+    }
+    // 待っている間に他の一覧で置き換えられていれば、respond_listing()がその場で描画する
+    if (l->info && strcmp(l->path, task->dirpath) == 0 && listing_matches(l, &task->dirst)) {
+        l->info->refcount++;
+        conn->listing = l->info;
+    }
+    free(task->dirpath);
+}
+
+// lookup_starter。スレッドのキューに順に振り分ける。どのキューも一杯ならこの場で調べる
+static int pool_submit(struct Connection *conn, void *arg) {
+    struct ThreadPool *pool = arg;
+    struct FileTask *task;
+    unsigned long depth;
+    int i;
+
+    task = xmalloc(sizeof(struct FileTask));
+    task->next = NULL;
+    task->conn = conn;
+    task->info = conn->lookup;
+    task->req = conn->pending;
+    clock_gettime(CLOCK_MONOTONIC, &task->queued);
+    prepare_listing_task(task);
+
+    // 積んだ途端にスレッドが取って減らすことがあるので、pendingは積む前に増やしておく
+    depth = __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < pool->nthreads; i++) {
+        if (queue_push(&pool->queues[(pool->next_queue + i) % pool->nthreads], task)) {
+            break;
+        }
+    }
+    pool->next_queue++;
+    if (i == pool->nthreads) {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        run_file_task(task);
+        listing_done(conn, task);
+        lookup_done(conn);
+        free(task);
+        return 0;
+    }
+
+    conn->task = task;
+    __atomic_store_n(&my_stats->pool_queue_depth, depth, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 1;
+}
+
+// eventfdで起こされたら完了したタスクをまとめて取り出し、待っていた接続の処理を再開する
+static void pool_complete(int epfd, struct ThreadPool *pool, char *docroot) {
+    struct FileTask *task, *next, *list = NULL;
+    uint64_t n;
+
+    if (read(pool->efd, &n, sizeof n) < 0 && !WOULD_BLOCK(errno)) {
+        log_error("failed to read eventfd: %s", strerror(errno));
+    }
+    // スタックなので積まれた順に並べ直す
+    for (task = __atomic_exchange_n(&pool->done, NULL, __ATOMIC_ACQUIRE); task; task = next) {
+        next = task->next;
+        task->next = list;
+        list = task;
+    }
+    for (task = list; task; task = next) {
+        struct Connection *conn = task->conn;
+
+        next = task->next;
+        conn->task = NULL;
+        listing_done(conn, task);
+        lookup_done(conn);
+        free(task);
+        handle_connection(epfd, conn, docroot);
+    }
+}
+
+#ifdef HAVE_IO_URING
+// 1本の投入キューと完了キュー。SQPOLLは使わないので、SQEはio_uring_enter(2)を呼ぶまでに埋めれば良い
+struct Uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    int multishot_accept;  // 5.19より前のカーネルではEINVALになるので、その時は1回ずつ投入し直す
+    int zerocopy;          // IORING_OP_SEND_ZCが使えなければ0にする
+    int timer_armed;
+};
+
+// ゼロコピー送信はカーネルがバッファを使い終えた通知が後から届くので、それまで中身の参照を持っておく
+struct UringZeroCopy {
+    struct EventSource source;
+    struct Connection *conn;  // 送信結果が届いたらNULLにする
+    struct HotContent *content;
+};
+
+static struct EventSource timer_source = {SOURCE_TIMER};
+
+static void uring_setup(struct Uring *ring, unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof p);
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        log_exit("io_uring_setup(2) failed: %s", strerror(errno));
+    }
+    // IORING_OP_SPLICEなどを使うので5.7以降が必要
+    if (!(p.features & IORING_FEAT_FAST_POLL)) {
+        log_exit("io_uring on this kernel is too old");
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            log_exit("mmap(2) failed: %s", strerror(errno));
+        }
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->to_submit = 0;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->multishot_accept = 1;
+    ring->zerocopy = 1;
+    ring->timer_armed = 0;
+}
+
+// 溜まったSQEをまとめて投入し、waitが1なら完了を1つ以上待つ
+static void uring_enter(struct Uring *ring, unsigned wait) {
+    int n;
+
+    n = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                      NULL, 0);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return;
+        }
+        log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+    }
+    ring->to_submit -= n;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct Uring *ring, int opcode, int fd, void *data) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail, index;
+
+    // SQが一杯ならいったんカーネルに渡して空ける
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_enter(ring, 0);
+    }
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long) data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_accept(struct Uring *ring, int server_fd) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring, IORING_OP_ACCEPT, server_fd, &listener_source);
+    sqe->accept_flags = SOCK_CLOEXEC;
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (ring->multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+#endif
+}
+
+static void uring_watch_inotify(struct Uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring, IORING_OP_POLL_ADD, file_cache->inotify_fd, file_cache);
+    sqe->poll32_events = POLLIN;
+}
+
+static void uring_arm_timer(struct Uring *ring) {
+    static struct __kernel_timespec ts = {1, 0};
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring, IORING_OP_TIMEOUT, -1, &timer_source);
+    sqe->addr = (unsigned long) &ts;
+    sqe->len = 1;
+    ring->timer_armed = 1;
+}
+
+// 受信を投入する。inbufを広げられなければ-1
+static int uring_recv(struct Uring *ring, struct Connection *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->inlen == conn->incap) {
+        if (conn->incap >= MAX_REQUEST_HEADER_LENGTH + MAX_REQUEST_BODY_LENGTH) {
+            return -1;
+        }
+        grow_input(conn, conn->incap * 2);
+    }
+    sqe = uring_get_sqe(ring, IORING_OP_RECV, conn->sock, conn);
+    sqe->addr = (unsigned long) (conn->inbuf + conn->inlen);
+    sqe->len = conn->incap - conn->inlen;
+    conn->uring_op = UOP_RECV;
+    return 0;
+}
+
+// lookup_starter。statx(2)を投入して、結果はconn->lookupに書く
+static int uring_start_lookup(struct Connection *conn, void *arg) {
+    struct Uring *ring = arg;
+    struct io_uring_sqe *sqe;
+
+    if (!conn->stx) {
+        conn->stx = xmalloc(sizeof(struct statx));
+    }
+    sqe = uring_get_sqe(ring, IORING_OP_STATX, AT_FDCWD, conn);
+    sqe->addr = (unsigned long) conn->lookup->path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (unsigned long) conn->stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    conn->uring_op = UOP_STATX;
+    return 1;
+}
+
+static void uring_open(struct Uring *ring, struct Connection *conn) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, conn);
+    sqe->addr = (unsigned long) conn->lookup->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    conn->uring_op = UOP_OPENAT;
+}
+
+static void uring_send_zc(struct Uring *ring, struct Connection *conn) {
+#ifdef IORING_CQE_F_NOTIF
+    struct io_uring_sqe *sqe;
+    struct UringZeroCopy *zc;
+
+    zc = xmalloc(sizeof(struct UringZeroCopy));
+    zc->source.type = SOURCE_ZC_SEND;
+    zc->conn = conn;
+    zc->content = conn->body_content;
+    zc->content->refcount++;
+    sqe = uring_get_sqe(ring, IORING_OP_SEND_ZC, conn->sock, zc);
+    sqe->addr = (unsigned long) (conn->body_content->data + conn->body_offset);
+    sqe->len = conn->body_remain;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->uring_op = UOP_SEND_ZC;
+#endif
+}
+
+// send_response()のio_uring版。次の送信を1つ投入して0を返す。送り終えていれば1
+static int uring_send_next(struct Uring *ring, struct Connection *conn) {
+    struct io_uring_sqe *sqe;
+    struct BodySegment *seg;
+    size_t head = conn->out.len - conn->outpos;
+    char *mem = NULL;
+    int zc = 0, more;
+
+    // 複数範囲では今のセグメントを送り終えたら次へ進む
+    while (conn->segment_index < conn->nsegments && conn->body_remain == 0 && conn->piped == 0) {
+        if (++conn->segment_index < conn->nsegments) {
+            seg = &conn->segments[conn->segment_index];
+            conn->body_offset = seg->offset;
+            conn->body_remain = seg->length;
+        }
+    }
+
+    if (conn->body_content) {
+        mem = conn->body_content->data;
+#ifdef IORING_CQE_F_NOTIF
+        // 大きなボディはコピーせずに送る。ヘッダは先に普通に送る
+        zc = ring->zerocopy && conn->body_remain >= URING_ZC_MIN;
+#endif
+        if (zc && head == 0) {
+            uring_send_zc(ring, conn);
+            return 0;
+        }
+    } else if (conn->segment_index < conn->nsegments && conn->segments[conn->segment_index].in_memory) {
+        mem = conn->parts.data;
+    }
+
+    // ヘッダとメモリ上のボディはsendmsgで1回にまとめる
+    if (head > 0 || (mem && conn->body_remain > 0)) {
+        conn->iov[0].iov_base = conn->out.data + conn->outpos;
+        conn->iov[0].iov_len = head;
+        conn->iov[1].iov_base = mem ? mem + conn->body_offset : NULL;
+        conn->iov[1].iov_len = mem && !zc ? conn->body_remain : 0;
+        memset(&conn->msg, 0, sizeof conn->msg);
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = 2;
+        more = (mem && zc) || (!mem && conn->body_fd >= 0 && conn->body_remain > 0)
+               || conn->segment_index + 1 < conn->nsegments;
+
+        sqe = uring_get_sqe(ring, IORING_OP_SENDMSG, conn->sock, conn);
+        sqe->addr = (unsigned long) &conn->msg;
+        sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        conn->uring_op = UOP_SENDMSG;
+        return 0;
+    }
+
+    // ファイルのボディはファイル→パイプ→ソケットとカーネル内で移す
+    if (conn->body_fd >= 0 && (conn->piped > 0 || conn->body_remain > 0)) {
+        if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+            log_error("pipe2(2) failed: %s", strerror(errno));
+            return -1;
+        }
+        if (conn->piped > 0) {
+            sqe = uring_get_sqe(ring, IORING_OP_SPLICE, conn->sock, conn);
+            sqe->splice_fd_in = conn->pipefd[0];
+            sqe->splice_off_in = (unsigned long) -1;
+            sqe->off = (unsigned long) -1;
+            sqe->len = conn->piped;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            conn->uring_op = UOP_SPLICE_OUT;
+        } else {
+            sqe = uring_get_sqe(ring, IORING_OP_SPLICE, conn->pipefd[1], conn);
+            sqe->splice_fd_in = conn->body_fd;
+            sqe->splice_off_in = conn->body_offset;
+            sqe->off = (unsigned long) -1;
+            sqe->len = conn->body_remain < SEND_BUF_SIZE ? (unsigned) conn->body_remain : SEND_BUF_SIZE;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            conn->uring_op = UOP_SPLICE_IN;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// pump_upload()のio_uring版。ソケットからblockbufに受け取ってファイルに書く操作を1つ投入して0を返す。
+// 受け取り終えたか書き込みに失敗していれば1
+static int uring_upload_next(struct Uring *ring, struct Connection *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->upload_fd < 0) {
+        return 1;
+    }
+    if (!conn->blockbuf) {
+        conn->blockbuf = xmalloc(SEND_BUF_SIZE);
+    }
+    if (conn->blockpos < conn->blocklen) {
+        sqe = uring_get_sqe(ring, IORING_OP_WRITE, conn->upload_fd, conn);
+        sqe->addr = (unsigned long) (conn->blockbuf + conn->blockpos);
+        sqe->len = conn->blocklen - conn->blockpos;
+        sqe->off = conn->upload_size;
+        conn->uring_op = UOP_UPLOAD_WRITE;
+        return 0;
+    }
+    if (conn->upload_remain == 0) {
+        return 1;
+    }
+    sqe = uring_get_sqe(ring, IORING_OP_RECV, conn->sock, conn);
+    sqe->addr = (unsigned long) conn->blockbuf;
+    sqe->len = conn->upload_remain < SEND_BUF_SIZE ? (unsigned) conn->upload_remain : SEND_BUF_SIZE;
+    conn->uring_op = UOP_UPLOAD_RECV;
+    return 0;
+}
+
+// 投入中の操作がなくなった接続を、送信→次のリクエストの処理→受信の順に進める
+static void uring_advance(struct Uring *ring, struct Connection *conn, char *docroot) {
+    int n;
+
+    conn->uring_op = UOP_NONE;
+    for (;;) {
+        if (conn->state == CONN_UPLOADING) {
+            if (!uring_upload_next(ring, conn)) {
+                wait_with_timeout(conn);
+                return;
+            }
+            timer_stop(&conn->timer);
+            upload_received(conn, docroot);
+            conn->state = CONN_WRITING;
+        }
+        if (conn->state == CONN_WRITING) {
+            n = uring_send_next(ring, conn);
+            if (n < 0) {
+                free_connection(conn);
+            }
+            if (n <= 0) {
+                return;
+            }
+            finish_response(conn);
+            if (!conn->keep_alive) {
+                free_connection(conn);
+                return;
+            }
+            reset_response(conn);
+        }
+
+        n = process_request_async(conn, docroot, uring_start_lookup, ring);
+        if (n == REQ_UPLOADING) {
+            continue;
+        }
+        if (n == REQ_PENDING) {
+            wait_pending(conn);
+            return;
+        }
+        if (n == REQ_INCOMPLETE) {
+            if (conn->eof || uring_recv(ring, conn) < 0) {
+                free_connection(conn);
+            } else {
+                wait_with_timeout(conn);
+            }
+            return;
+        }
+        timer_stop(&conn->timer);
+        conn->state = CONN_WRITING;
+    }
+}
+
+// sendmsgで送れた分だけヘッダ、続いてメモリ上のボディを進める
+static void uring_sent(struct Connection *conn, size_t n) {
+    size_t head = conn->out.len - conn->outpos;
+
+    if (n <= head) {
+        conn->outpos += n;
+    } else {
+        conn->outpos = conn->out.len;
+        conn->body_offset += n - head;
+        conn->body_remain -= n - head;
+    }
+}
+
+static void uring_complete(struct Uring *ring, struct Connection *conn, int res, char *docroot) {
+    struct statx *stx = conn->stx;
+
+    switch (conn->uring_op) {
+        case UOP_RECV:
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                free_connection(conn);
+                return;
+            }
+            if (res < 0) {
+                break;
+            }
+            if (res == 0) {
+                conn->eof = 1;
+            } else if (conn->inlen == 0) {
+                conn->t_request = now_us();
+            }
+            conn->inlen += res;
+            break;
+        case UOP_STATX:
+            if (res == 0 && S_ISREG(stx->stx_mode)) {
+                set_fileinfo_stat(conn->lookup, stx->stx_ino, stx->stx_size, stx->stx_mtime.tv_sec,
+                                  stx->stx_mtime.tv_nsec);
+            } else if (res == 0) {
+                conn->lookup->is_dir = S_ISDIR(stx->stx_mode);
+            }
+            if (lookup_needs_open(conn->pending, conn->lookup)) {
+                uring_open(ring, conn);
+                return;
+            }
+            lookup_done(conn);
+            break;
+        case UOP_OPENAT:
+            // 開けなければdo_file_respond()がもう一度試してエラーを記録する
+            if (res >= 0) {
+                conn->lookup->fd = res;
+            }
+            lookup_done(conn);
+            break;
+        case UOP_SENDMSG:
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                free_connection(conn);
+                return;
+            }
+            if (res > 0) {
+                uring_sent(conn, res);
+            }
+            break;
+        case UOP_SPLICE_IN:
+            if (res <= 0 && res != -EINTR && res != -EAGAIN) {
+                log_error("failed to send response body: %s", res < 0 ? strerror(-res) : "unexpected EOF");
+                free_connection(conn);
+                return;
+            }
+            if (res > 0) {
+                conn->piped = res;
+                conn->body_offset += res;
+                conn->body_remain -= res;
+            }
+            break;
+        case UOP_SPLICE_OUT:
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                free_connection(conn);
+                return;
+            }
+            if (res > 0) {
+                conn->piped -= res;
+            }
+            break;
+        case UOP_UPLOAD_RECV:
+            if (res <= 0 && res != -EINTR && res != -EAGAIN) {
+                free_connection(conn);
+                return;
+            }
+            if (res > 0) {
+                conn->blocklen = res;
+                conn->blockpos = 0;
+                conn->upload_remain -= res;
+            }
+            break;
+        case UOP_UPLOAD_WRITE:
+            if (res <= 0 && res != -EINTR && res != -EAGAIN) {
+                log_error("failed to write %s: %s", conn->upload_tmp, res < 0 ? strerror(-res) : "short write");
+                fail_upload(conn);
+            } else if (res > 0) {
+                conn->blockpos += res;
+                conn->upload_size += res;
+            }
+            break;
+    }
+    uring_advance(ring, conn, docroot);
+}
+
+static void uring_complete_zc(struct Uring *ring, struct UringZeroCopy *zc, int res, unsigned flags, char *docroot) {
+#ifdef IORING_CQE_F_NOTIF
+    struct Connection *conn = zc->conn;
+
+    // 通知が来ればバッファはもう使われていない。結果にF_MOREがなければ通知は来ない
+    if ((flags & IORING_CQE_F_NOTIF) || !(flags & IORING_CQE_F_MORE)) {
+        release_content(zc->content);
+        free(zc);
+    } else {
+        zc->conn = NULL;
+    }
+    if (!conn) {
+        return;
+    }
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+        ring->zerocopy = 0;
+    } else if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        free_connection(conn);
+        return;
+    } else if (res > 0) {
+        conn->body_offset += res;
+        conn->body_remain -= res;
+    }
+    uring_advance(ring, conn, docroot);
+#endif
+}
+
+static void uring_complete_accept(struct Uring *ring, int server_fd, int res, unsigned flags) {
+    struct Connection *conn;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (draining) {
+            close(server_fd);
+        } else {
+            if (res == -EINVAL && ring->multishot_accept) {
+                ring->multishot_accept = 0;
+            }
+            uring_accept(ring, server_fd);
+        }
+    }
+    if (res < 0) {
+        if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN && res != -EINVAL && res != -ECANCELED) {
+            log_error("accept failed: %s", strerror(-res));
+        }
+        return;
+    }
+    __atomic_fetch_add(&my_stats->accepted, 1, __ATOMIC_RELAXED);
+    conn = new_connection(res);
+    if (uring_recv(ring, conn) < 0) {
+        free_connection(conn);
+    } else {
+        wait_with_timeout(conn);
+    }
+}
+
+// 投入中の受け付けを取り消す。最後の完了が返ってきたところでuring_complete_accept()がソケットを閉じる
+static void uring_stop_accepting(struct Uring *ring) {
+    static struct EventSource cancel_source = {SOURCE_CANCEL};
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, &cancel_source);
+    sqe->addr = (unsigned long) &listener_source;
+}
+
+// POLL_ADDは1回きりなので、状態の変わったハンドラへの接続ごとに投入し直す
+static void uring_watch_channels(struct Uring *ring) {
+    struct HandlerChannel *ch;
+    struct io_uring_sqe *sqe;
+
+    for (ch = dirty_channels; ch; ch = ch->dirty_next) {
+        ch->dirty = 0;
+        if (ch->fd < 0) {
+            continue;
+        }
+        if (!(ch->polling & POLLIN)) {
+            sqe = uring_get_sqe(ring, IORING_OP_POLL_ADD, ch->fd, &ch->source);
+            sqe->poll32_events = POLLIN;
+            ch->polling |= POLLIN;
+        }
+        if (ch->outpos < ch->out.len && !(ch->polling & POLLOUT)) {
+            sqe = uring_get_sqe(ring, IORING_OP_POLL_ADD, ch->fd, &ch->out_source);
+            sqe->poll32_events = POLLOUT;
+            ch->polling |= POLLOUT;
+        }
+    }
+    dirty_channels = NULL;
+}
+
+// タイムアウトした接続は送受信を止めるだけにして、投入中の受信が0で返ってきたところで解放する
+static void uring_expire(struct Connection *conn) {
+    shutdown(conn->sock, SHUT_RDWR);
+}
+
+// ワーカーごとに1本のリングで受け付け・受信・statx/openat・送信をまとめて投入する
+static void uring_server_main(int server_fd, char *docroot) {
+    static struct Uring ring;
+    struct io_uring_cqe *cqe;
+    struct EventSource *source;
+    unsigned head, flags;
+    int res;
+
+    uring_setup(&ring, URING_ENTRIES);
+    wheel_init();
+    setup_caches();
+    setup_channels();
+    if (file_cache) {
+        uring_watch_inotify(&ring);
+    }
+    if (workers == 0) {
+        my_stats->pid = getpid();
+    }
+    trap_control_signals();
+    uring_accept(&ring, server_fd);
+
+    for (;;) {
+        if ((wheel.count > 0 || draining) && !ring.timer_armed) {
+            uring_arm_timer(&ring);
+        }
+        uring_enter(&ring, 1);
+
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            source = (struct EventSource *) (unsigned long) cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            switch (source->type) {
+                case SOURCE_LISTENER:
+                    uring_complete_accept(&ring, server_fd, res, flags);
+                    break;
+                case SOURCE_INOTIFY:
+                    handle_inotify_events((struct FileCache *) source);
+                    uring_watch_inotify(&ring);
+                    break;
+                case SOURCE_TIMER:
+                    ring.timer_armed = 0;
+                    run_timers(uring_expire);
+                    if (draining) {
+                        close_idle_connections(uring_expire);
+                    }
+                    break;
+                case SOURCE_ZC_SEND:
+                    uring_complete_zc(&ring, (struct UringZeroCopy *) source, res, flags, docroot);
+                    break;
+                case SOURCE_CANCEL:
+                    break;
+                case SOURCE_HANDLER:
+                    ((struct HandlerChannel *) source)->polling &= ~POLLIN;
+                    channel_ready((struct HandlerChannel *) source, 0);
+                    break;
+                case SOURCE_HANDLER_OUT: {
+                    struct HandlerChannel *ch;
+
+                    ch = (struct HandlerChannel *) ((char *) source - offsetof(struct HandlerChannel, out_source));
+                    ch->polling &= ~POLLOUT;
+                    channel_ready(ch, 1);
+                    break;
+                }
+                default:
+                    uring_complete(&ring, (struct Connection *) source, res, docroot);
+                    break;
+            }
+        }
+        if (channels) {
+            struct Connection *conn, *next;
+
+            while (answered_calls) {
+                for (conn = take_answered_calls(); conn; conn = next) {
+                    next = conn->call_next;
+                    uring_advance(&ring, conn, docroot);
+                }
+            }
+            uring_watch_channels(&ring);
+        }
+        if (master_signal && handle_control_signal(&server_fd, 1)) {
+            uring_stop_accepting(&ring);
+            begin_drain();
+            close_idle_connections(uring_expire);
+        }
+        if (draining && drained()) {
+            finish_draining();
+        }
+    }
+}
+#endif
+
+static int read_request_line(struct HTTPRequest *req, char *buf);
+
+static struct HTTPHeaderField *read_header_field(struct Arena *arena, char *buf);
+
+static int index_header_field(struct HTTPRequest *req, struct HTTPHeaderField *h);
+
+static long content_length(struct HTTPRequest *req);
+
+static int request_keep_alive(struct HTTPRequest *req);
+
+static void *arena_alloc(struct Arena *arena, size_t sz) {
+    struct ArenaChunk *chunk = arena->head;
+    void *p;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (!chunk || chunk->used + sz > chunk->size) {
+        size_t size = sz > ARENA_CHUNK_SIZE ? sz : ARENA_CHUNK_SIZE;
+
+        chunk = xmalloc(sizeof(struct ArenaChunk) + size);
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = size;
+        arena->head = chunk;
+    }
+    p = chunk->data + chunk->used;
+    chunk->used += sz;
+    return p;
+}
+
+// 最初のチャンクだけは残して次のリクエストで使い回す
+static void arena_reset(struct Arena *arena) {
+    struct ArenaChunk *chunk;
+
+    while (arena->head && arena->head->next) {
+        chunk = arena->head;
+        arena->head = chunk->next;
+        free(chunk);
+    }
+    if (arena->head) {
+        arena->head->used = 0;
+    }
+}
+
+static void arena_free(struct Arena *arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+// ヘッダの終わりを示す空行の直後の位置を返す。まだ届いていなければNULL
+// 前回見終わった位置から探索を再開するので、少しずつ届いても同じバイトを何度も走査しない
+static char *find_header_end(struct Connection *conn) {
+    char *buf = conn->inbuf;
+    char *end = buf + conn->inlen;
+    char *p;
+
+    for (p = buf + conn->scan_pos; p < end; p++) {
+        p = memchr(p, '\n', end - p);
+        if (!p) {
+            break;
+        }
+        if (p + 1 == end || (p[1] == '\r' && p + 2 == end)) {
+            // 改行の後ろがまだ届いていないので、この改行から見直す
+            conn->scan_pos = p - buf;
+            return NULL;
+        }
+        if (p[1] == '\n') {
+            return p + 2;
+        }
+        if (p[1] == '\r' && p[2] == '\n') {
+            return p + 3;
+        }
+    }
+    conn->scan_pos = conn->inlen;
+    return NULL;
+}
+
+// 行末の改行をヌル文字で潰し、次の行の先頭を返す
+static char *terminate_line(char *line, char *end) {
+    char *nl;
+
+    nl = memchr(line, '\n', end - line);
+    *nl = '\0';
+    if (nl > line && nl[-1] == '\r') {
+        nl[-1] = '\0';
+    }
+    return nl + 1;
+}
+
+static int header_id(char *name, size_t len) {
+    int id;
+
+    if (len == 0) {
+        return HDR_UNKNOWN;
+    }
+    id = header_hash_table[HEADER_HASH(len, name[0], name[len - 1])];
+    if (id != HDR_UNKNOWN && known_headers[id].len == len && strncasecmp(known_headers[id].name, name, len) == 0) {
+        return id;
+    }
+    return HDR_UNKNOWN;
+}
+
+// 大文字小文字を区別しないFNV-1a
+static unsigned int header_name_hash(char *name, size_t len) {
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) tolower((unsigned char) name[i])) * 16777619u;
+    }
+    return h;
+}
+
+// 同じ名前のヘッダが複数あれば最初のものを引けるようにする。
+// ボディの終わりや宛先を決めるヘッダが違う値で重なっていれば、前段のプロキシと解釈が食い違わないよう-1を返す
+static int index_header_field(struct HTTPRequest *req, struct HTTPHeaderField *h) {
+    struct HTTPHeaderField **bucket;
+    int id;
+
+    id = header_id(h->name, h->name_len);
+    if (id != HDR_UNKNOWN) {
+        if (!req->known[id]) {
+            req->known[id] = h;
+        } else if ((id == HDR_CONTENT_LENGTH || id == HDR_HOST || id == HDR_TRANSFER_ENCODING)
+                   && strcasecmp(req->known[id]->value, h->value) != 0) {
+            log_error("conflicting %.*s headers", (int) h->name_len, h->name);
+            return -1;
+        }
+        return 0;
+    }
+    bucket = &req->other[header_name_hash(h->name, h->name_len) % OTHER_HEADER_BUCKETS];
+    while (*bucket) {
+        bucket = &(*bucket)->bucket_next;
+    }
+    *bucket = h;
+    return 0;
+}
+
+// ヘッダブロックをinbufの中でそのまま解析する。確保はすべてコネクションのアリーナから行う
+static struct HTTPRequest *read_request_header(struct Connection *conn, char *end) {
+    struct HTTPRequest *req;
+    struct HTTPHeaderField *h, **tail;
+    char *line, *next;
+
+    req = arena_alloc(&conn->arena, sizeof(struct HTTPRequest));
+    req->method = NULL;
+    req->path = NULL;
+    req->header = NULL;
+    memset(req->known, 0, sizeof req->known);
+    memset(req->other, 0, sizeof req->other);
+    req->body = NULL;
+    req->length = 0;
+    req->streamed = 0;
+    req->arena = &conn->arena;
+
+    line = conn->inbuf;
+    next = terminate_line(line, end);
+    if (read_request_line(req, line) < 0) {
+        return NULL;
+    }
+
+    tail = &req->header;
+    for (line = next; line < end; line = next) {
+        next = terminate_line(line, end);
+        if (*line == '\0') {
+            break;
+        }
+        h = read_header_field(&conn->arena, line);
+        if (!h) {
+            return NULL;
+        }
+        *tail = h;
+        tail = &h->next;
+        if (index_header_field(req, h) < 0) {
+            return NULL;
+        }
+    }
+    return req;
+}
+
+static void rebase_request(struct HTTPRequest *req, char *old, char *new) {
+    struct HTTPHeaderField *h;
+
+#define REBASE(p) ((p) = (p) ? new + ((p) - old) : NULL)
+    REBASE(req->method);
+    REBASE(req->path);
+    REBASE(req->body);
+    for (h = req->header; h; h = h->next) {
+        REBASE(h->name);
+        REBASE(h->value);
+    }
+#undef REBASE
+}
+
+static int is_upload_request(struct HTTPRequest *req);
+
+// 部分的にしか届いていない場合はREQ_INCOMPLETEを返す。ヘッダは一度だけ解析し、ボディを待つ間はconn->reqに残す
+static int read_request(struct Connection *conn, struct HTTPRequest **reqp) {
+    struct HTTPRequest *req = conn->req;
+    char *header_end;
+    int result;
+
+    if (!req) {
+        header_end = find_header_end(conn);
+        if (!header_end) {
+            if (conn->inlen > MAX_REQUEST_HEADER_LENGTH) {
+                log_error("request header too long");
+                return REQ_BAD;
+            }
+            return REQ_INCOMPLETE;
+        }
+        conn->header_len = header_end - conn->inbuf;
+
+        req = read_request_header(conn, header_end);
+        if (!req) {
+            arena_reset(&conn->arena);
+            return REQ_BAD;
+        }
+        // chunkedは解釈しないので、ボディの終わりが分からないまま次のリクエストを読むことがないよう接続ごと断る。
+        // Content-Lengthと一緒なら食い違いを狙ったリクエストとみなして400にする
+        if (lookup_header_field_value(req, "Transfer-Encoding")) {
+            log_error("Transfer-Encoding is not supported");
+            result = lookup_header_field_value(req, "Content-Length") ? REQ_BAD : REQ_UNSUPPORTED;
+            arena_reset(&conn->arena);
+            return result;
+        }
+        req->keep_alive = request_keep_alive(req);
+        req->length = content_length(req);
+        if (req->length < 0) {
+            arena_reset(&conn->arena);
+            return REQ_BAD;
+        }
+        // アップロードのボディは大きさに関係なく、start_upload()以降でファイルに流す
+        req->streamed = is_upload_request(req);
+        if (!req->streamed && req->length > MAX_REQUEST_BODY_LENGTH) {
+            log_error("request body too long");
+            arena_reset(&conn->arena);
+            return REQ_BAD;
+        }
+
+        // ボディ全体が収まる大きさを先に確保しておき、以後はバッファが動かないようにする
+        conn->req = req;
+        if (!req->streamed && conn->incap < conn->header_len + req->length) {
+            grow_input(conn, conn->header_len + req->length);
+        }
+        if (!req->streamed && req->length != 0) {
+            req->body = conn->inbuf + conn->header_len;
+        }
+    }
+
+    if (!req->streamed && conn->inlen < conn->header_len + req->length) {
+        return REQ_INCOMPLETE;
+    }
+    *reqp = req;
+    return REQ_OK;
+}
+
+// レスポンスを作り終えたリクエストをinbufから取り除く。後ろにパイプライン化されたリクエストがあれば前に詰める
+// アップロードのボディはstart_upload()がinbufから取り除いている
+static void consume_request(struct Connection *conn) {
+    size_t consumed = conn->header_len + (conn->req->streamed ? 0 : conn->req->length);
+
+    free_request(conn->req);
+    conn->req = NULL;
+    memmove(conn->inbuf, conn->inbuf + consumed, conn->inlen - consumed);
+    conn->inlen -= consumed;
+    conn->scan_pos = 0;
+    conn->header_len = 0;
+    // パイプライン化された次のリクエストはここから計る
+    conn->t_request = conn->inlen > 0 ? now_us() : 0;
+}
+
+static void upcase(char *str) {
+    char *p;
+    for (p = str; *p; p++) {
+        *p = (char) toupper((int) *p);
+    }
+}
+
+static int read_request_line(struct HTTPRequest *req, char *buf) {
+    char *path, *p;
+
+    // 1つ目の空白までポインタpを移動
+    p = strchr(buf, ' ');
+    if (!p) {
+        log_error("parse error on request line (1): %s", buf);
+        return -1;
+    }
+    // 空白部分をヌル文字で上書きして、ポインタを1つ進める
+    *p++ = '\0';
+
+    // メソッドはバッファ内をそのまま指し、大文字に変更する
+    req->method = buf;
+    upcase(req->method);
+
+    // ポインタpathに現在のアドレスをセット
+    path = p;
+    // 2つ目の空白までポインタpを移動
+    p = strchr(path, ' ');
+    if (!p) {
+        log_error("parse error on request line (2): %s", buf);
+        return -1;
+    }
+    // 空白部分をヌル文字で上書きして、ポインタを1つ進める
+    *p++ = '\0';
+
+    // パスもコピーせずバッファ内を指す
+    req->path = path;
+
+    // HTTPのバージョンを確認／HTTP1系しか受け付けない
+    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0) {
+        log_error("parse error on request line (3): %s", buf);
+        return -1;
+    }
+    // ポインタpをHTTPのマイナーバージョンまで進める
+    p += strlen("HTTP/1.");
+    // HTTPのマイナーバージョンをセット
+    req->protocol_minor_version = atoi(p);
+    return 0;
+}
+
+static struct HTTPHeaderField *read_header_field(struct Arena *arena, char *buf) {
+    struct HTTPHeaderField *h;
+    char *p, *end;
+
+    p = strchr(buf, ':');
+    if (!p) {
+        log_error("parse error on request header field: %s", buf);
+        return NULL;
+    }
+    *p++ = '\0';
+
+    h = arena_alloc(arena, sizeof(struct HTTPHeaderField));
+    h->name = buf;
+    h->name_len = p - 1 - buf;
+
+    // 前後の空白は値に含めない
+    p += strspn(p, " \t");
+    for (end = p + strlen(p); end > p && (end[-1] == ' ' || end[-1] == '\t'); end--) {
+        ;
+    }
+    *end = '\0';
+    h->value = p;
+    h->value_len = end - p;
+    h->next = NULL;
+    h->bucket_next = NULL;
+
+    return h;
+}
+
+// カンマ区切りのヘッダ値にtokenが含まれているかを大文字小文字を区別せずに調べる
+static int has_token(char *value, char *token) {
+    size_t len = strlen(token);
+    char *p = value;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (strncasecmp(p, token, len) == 0 && (p[len] == '\0' || strchr(" \t,", p[len]))) {
+            return 1;
+        }
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+static char *header_value(struct HTTPRequest *req, int id);
+
+// HTTP/1.1はデフォルトで持続的接続、HTTP/1.0は"Connection: keep-alive"が付いた時だけ持続させる
+static int request_keep_alive(struct HTTPRequest *req) {
+    char *val;
+
+    val = header_value(req, HDR_CONNECTION);
+    if (req->protocol_minor_version >= 1) {
+        return !(val && has_token(val, "close"));
+    }
+    return val && has_token(val, "keep-alive");
+}
+
+static char *header_value(struct HTTPRequest *req, int id) {
+    return req->known[id] ? req->known[id]->value : NULL;
+}
+
+static char *lookup_header_field_value(struct HTTPRequest *req, char *name) {
+    struct HTTPHeaderField *h;
+    size_t len = strlen(name);
+    int id;
+
+    id = header_id(name, len);
+    if (id != HDR_UNKNOWN) {
+        return header_value(req, id);
+    }
+    for (h = req->other[header_name_hash(name, len) % OTHER_HEADER_BUCKETS]; h; h = h->bucket_next) {
+        if (h->name_len == len && strncasecmp(h->name, name, len) == 0) {
+            return h->value;
+        }
+    }
+    return NULL;
+}
+
+static long content_length(struct HTTPRequest *req) {
+    char *val, *end;
+    long len;
+
+    val = lookup_header_field_value(req, "Content-Length");
+    if (!val) {
+        return 0;
+    }
+    // アップロードは2GBを超えることがあるのでatoi()では足りない
+    len = strtol(val, &end, 10);
+    if (end == val || *end != '\0') {
+        log_error("invalid Content-Length value");
+        return -1;
+    }
+    if (len < 0) {
+        log_error("negative Content-Length value");
+        return -1;
+    }
+    return len;
+}
+
+static void do_file_respond(struct HTTPRequest *req, struct Connection *conn, char *docroot);
+
+static void method_not_allowed(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void not_found(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void respond_stats(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void respond_upload(struct HTTPRequest *req, struct Connection *conn);
+
+static void respond_dynamic(struct HTTPRequest *req, struct Connection *conn);
+
+static void respond_to(struct HTTPRequest *req, struct Connection *conn, char *docroot) {
+    if (req->streamed) {
+        respond_upload(req, conn);
+    } else if (is_handler_request(req)) {
+        respond_dynamic(req, conn);
+    } else if (is_stats_request(req)) {
+        respond_stats(req, &conn->out);
+    } else if (strcmp(req->method, "GET") == 0) {
+        do_file_respond(req, conn, docroot);
+    } else if (strcmp(req->method, "HEAD") == 0) {
+        do_file_respond(req, conn, docroot);
     } else if (strcmp(req->method, "POST") == 0) {
-        method_not_allowed(req, out);
+        method_not_allowed(req, &conn->out);
+    } else {
+        not_implemented(req, &conn->out);
+    }
+}
+
+static struct FileInfo *get_fileinfo(char *docroot, char *urlpath);
+
+static void free_fileinfo(struct FileInfo *info);
+
+static void out_write(struct OutputBuffer *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        while (out->len + len > out->cap) {
+            out->cap *= 2;
+        }
+        out->data = realloc(out->data, out->cap);
+        if (!out->data) {
+            log_exit("failed to allocate memory");
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+static void out_puts(struct OutputBuffer *out, const char *str) {
+    out_write(out, str, strlen(str));
+}
+
+static void out_put_long(struct OutputBuffer *out, long n) {
+    char buf[24];
+    char *p = buf + sizeof buf;
+    unsigned long u = n < 0 ? -(unsigned long) n : (unsigned long) n;
+
+    do {
+        *--p = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (n < 0) {
+        *--p = '-';
+    }
+    out_write(out, p, buf + sizeof buf - p);
+}
+
+// bufはHTTP_DATE_SIZEバイト以上
+static void format_http_date(time_t t, char *buf) {
+    struct tm tm;
+
+    if (!gmtime_r(&t, &tm)) {
+        log_exit("gmtime failed: %s", strerror(errno));
+    }
+    strftime(buf, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// RFC 1123形式だけを受け付ける。解釈できなければ-1
+static time_t parse_http_date(char *str) {
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// Dateヘッダの値は1秒に1回だけ作り直す
+static char *http_date(void) {
+    static char buf[HTTP_DATE_SIZE];
+    static time_t cached = 0;
+    time_t t;
+
+    t = time(NULL);
+    if (t != cached) {
+        format_http_date(t, buf);
+        cached = t;
+    }
+    return buf;
+}
+
+static void output_common_header_fileds(struct HTTPRequest *req, struct OutputBuffer *out, char *status) {
+    out_puts(out, (req && req->protocol_minor_version >= 1) ? "HTTP/1.1 " : "HTTP/1.0 ");
+    out_puts(out, status);
+    out_puts(out, "\r\nDate: ");
+    out_puts(out, http_date());
+    out_puts(out, "\r\nServer: super server/2.3\r\n");
+    out_puts(out, (req && req->keep_alive) ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+}
+
+// 符号化した表現のETagは元のETagの閉じ引用符の前に"-gzip"などを付けて区別する
+static void encoded_etag(struct FileInfo *info, int enc, char *buf) {
+    if (enc == ENC_IDENTITY) {
+        strcpy(buf, info->etag);
+    } else {
+        snprintf(buf, ETAG_SIZE + 8, "%.*s-%s\"", (int) strlen(info->etag) - 1, info->etag, encoding_names[enc]);
+    }
+}
+
+static void out_validators(struct OutputBuffer *out, struct FileInfo *info, int enc) {
+    char etag[ETAG_SIZE + 8];
+
+    encoded_etag(info, enc, etag);
+    out_puts(out, "ETag: ");
+    out_puts(out, etag);
+    out_puts(out, "\r\nLast-Modified: ");
+    out_puts(out, info->last_modified);
+    out_puts(out, "\r\n");
+}
+
+// "W/\"a\", \"b\"" のような一覧にinfoのETagがあれば一致した表現の符号化を、なければ-1を返す。
+// 弱い比較ならW/付きや符号化した表現のETagも一致とみなす
+static int etag_matches(char *list, struct FileInfo *info, int weak) {
+    size_t base = strlen(info->etag) - 1;  // 閉じ引用符を除いた長さ
+    size_t len;
+    char *p = list, *end;
+    int is_weak, enc;
+
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            return -1;
+        }
+        if (*p == '*') {
+            return weak ? ENC_IDENTITY : -1;
+        }
+        is_weak = strncmp(p, "W/", 2) == 0;
+        if (is_weak) {
+            p += 2;
+        }
+        if (*p != '"' || (end = strchr(p + 1, '"')) == NULL) {
+            return -1;
+        }
+        len = end - p;
+        if ((weak || !is_weak) && len >= base && strncmp(p, info->etag, base) == 0) {
+            if (len == base) {
+                return ENC_IDENTITY;
+            }
+            for (enc = ENC_GZIP; weak && enc < ENC_COUNT; enc++) {
+                if (p[base] == '-' && len - base - 1 == strlen(encoding_names[enc])
+                    && strncmp(p + base + 1, encoding_names[enc], len - base - 1) == 0) {
+                    return enc;
+                }
+            }
+        }
+        p = end + 1;
+    }
+}
+
+// 変更がなければ304で返す表現の符号化を、あれば-1を返す。If-None-MatchがあればIf-Modified-Sinceより優先する
+static int not_modified(struct HTTPRequest *req, struct FileInfo *info) {
+    char *value;
+    time_t since;
+
+    if ((value = header_value(req, HDR_IF_NONE_MATCH)) != NULL) {
+        return etag_matches(value, info, 1);
+    }
+    if ((value = header_value(req, HDR_IF_MODIFIED_SINCE)) != NULL) {
+        since = parse_http_date(value);
+        return since >= 0 && info->mtime <= since ? ENC_IDENTITY : -1;
+    }
+    return -1;
+}
+
+// ETagはクライアントの持っている表現のものを返す
+static void respond_not_modified(struct HTTPRequest *req, struct OutputBuffer *out, struct FileInfo *info, int enc) {
+    output_common_header_fileds(req, out, "304 Not Modified");
+    out_validators(out, info, enc);
+    out_puts(out, "Vary: Accept-Encoding\r\n\r\n");
+}
+
+static struct HotContent *hot_content(struct FileInfo *info);
+
+static int parse_range(struct HTTPRequest *req, struct FileInfo *info, struct ByteRange *ranges);
+
+static void range_not_satisfiable(struct HTTPRequest *req, struct OutputBuffer *out, struct FileInfo *info);
+
+static void respond_ranges(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info,
+                           struct ByteRange *ranges, int nranges);
+
+static int accepted_encodings(struct HTTPRequest *req);
+
+static struct FileInfo *encoded_variant(char *docroot, char *urlpath, struct FileInfo *info, int enc);
+
+static struct HotContent *gzip_content(struct FileInfo *info);
+
+static void moved_to_directory(struct HTTPRequest *req, struct OutputBuffer *out);
+
+static void respond_listing(struct HTTPRequest *req, struct Connection *conn, char *docroot);
+
+// 組み立て済みのヘッダとメモリ上のボディで応答する
+static void respond_content(struct HTTPRequest *req, struct Connection *conn, struct HotContent *content) {
+    output_common_header_fileds(req, &conn->out, "200 OK");
+    out_write(&conn->out, content->headers, content->header_len);
+    if (strcmp(req->method, "HEAD") != 0) {
+        content->refcount++;
+        conn->body_content = content;
+        conn->body_offset = 0;
+        conn->body_remain = content->len;
+    }
+}
+
+static int open_fileinfo(struct FileInfo *info) {
+    if (info->fd >= 0) {
+        return 0;
+    }
+    info->fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (info->fd < 0) {
+        log_error("failed to open %s: %s", info->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// 受け入れられる符号化があれば、圧縮済みの兄弟ファイル（.br、.gzの順）か圧縮キャッシュで応答する
+static int respond_encoded(struct HTTPRequest *req, struct Connection *conn, char *docroot, struct FileInfo *info) {
+    struct FileInfo *variant;
+    struct HotContent *content;
+    struct OutputBuffer *out = &conn->out;
+    int accepted, enc;
+
+    accepted = accepted_encodings(req);
+    if (!accepted) {
+        return 0;
+    }
+    for (enc = ENC_COUNT - 1; enc > ENC_IDENTITY; enc--) {
+        if (!(accepted & (1 << enc))) {
+            continue;
+        }
+        variant = encoded_variant(docroot, req->path, info, enc);
+        if (!variant) {
+            continue;
+        }
+        if (strcmp(req->method, "HEAD") != 0 && open_fileinfo(variant) < 0) {
+            free_fileinfo(variant);
+            continue;
+        }
+        __atomic_fetch_add(&my_stats->compressed_responses, 1, __ATOMIC_RELAXED);
+        output_common_header_fileds(req, out, "200 OK");
+        out_puts(out, "Content-Length: ");
+        out_put_long(out, variant->size);
+        out_puts(out, "\r\nContent-Encoding: ");
+        out_puts(out, encoding_names[enc]);
+        out_puts(out, "\r\nVary: Accept-Encoding\r\n");
+        out_validators(out, info, enc);
+        out_puts(out, "Content-Type: ");
+        out_puts(out, info->content_type);
+        out_puts(out, "\r\n\r\n");
+        if (strcmp(req->method, "HEAD") != 0) {
+            conn->body_info = variant;
+            conn->body_fd = variant->fd;
+            conn->body_offset = 0;
+            conn->body_remain = variant->size;
+        } else {
+            free_fileinfo(variant);
+        }
+        return 1;
+    }
+    if ((accepted & (1 << ENC_GZIP)) && (content = gzip_content(info)) != NULL) {
+        __atomic_fetch_add(&my_stats->compressed_responses, 1, __ATOMIC_RELAXED);
+        respond_content(req, conn, content);
+        return 1;
+    }
+    return 0;
+}
+
+// ボディはここでは書かずにconnへ登録し、send_response()がソケットの状態に合わせて送る
+static void do_file_respond(struct HTTPRequest *req, struct Connection *conn, char *docroot) {
+    struct FileInfo *info;
+    struct HotContent *content;
+    struct OutputBuffer *out = &conn->out;
+    struct ByteRange ranges[MAX_RANGES];
+    int nranges = 0, enc;
+
+    if (conn->lookup) {
+        info = conn->lookup;
+        conn->lookup = NULL;
+    } else {
+        long long t = now_us();
+
+        info = get_fileinfo(docroot, req->path);
+        conn->lookup_us = now_us() - t;
+        record_latency(STAGE_LOOKUP, conn->lookup_us);
+    }
+    // クライアントの持っているものが最新なら、ファイルを開きもせずに304を返す
+    if (info->ok && (enc = not_modified(req, info)) >= 0) {
+        respond_not_modified(req, out, info, enc);
+        free_fileinfo(info);
+        return;
+    }
+    if (info->ok) {
+        nranges = parse_range(req, info, ranges);
+        if (nranges < 0) {
+            range_not_satisfiable(req, out, info);
+            free_fileinfo(info);
+            return;
+        }
+    }
+
+    // 範囲指定は符号化していない表現に対して扱う
+    if (info->ok && nranges == 0 && respond_encoded(req, conn, docroot, info)) {
+        free_fileinfo(info);
+        return;
+    }
+    // 圧縮した表現を返すなら元のファイルは開かない
+    if (info->ok && strcmp(req->method, "HEAD") != 0 && open_fileinfo(info) < 0) {
+        info->ok = 0;
+    }
+
+    // ホットキャッシュに載っていれば組み立て済みのヘッダとメモリ上のボディをそのまま使う
+    if (info->ok && nranges == 0 && (content = hot_content(info)) != NULL) {
+        __atomic_fetch_add(&my_stats->hot_cache_hits, 1, __ATOMIC_RELAXED);
+        respond_content(req, conn, content);
+        free_fileinfo(info);
+        return;
+    }
+
+    if (!info->ok) {
+        // "/"を付け忘れたディレクトリは付けた先へ、index.htmlのないディレクトリは一覧を返す
+        if (info->is_dir) {
+            moved_to_directory(req, out);
+        } else if (autoindex && req->path[strlen(req->path) - 1] == '/') {
+            respond_listing(req, conn, docroot);
+        } else {
+            not_found(req, out);
+        }
+        free_fileinfo(info);
+        return;
+    }
+    if (nranges > 0) {
+        respond_ranges(req, conn, info, ranges, nranges);
+        return;
+    }
+
+    output_common_header_fileds(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, info->size);
+    out_puts(out, "\r\nAccept-Ranges: bytes\r\nVary: Accept-Encoding\r\n");
+    out_validators(out, info, ENC_IDENTITY);
+    out_puts(out, "Content-Type: ");
+    out_puts(out, info->content_type);
+    out_puts(out, "\r\n\r\n");
+
+    if (strcmp(req->method, "HEAD") != 0) {
+        // 参照はconnに移し、送り終えたらreset_response()で手放す
+        conn->body_info = info;
+        conn->body_fd = info->fd;
+        conn->body_offset = 0;
+        conn->body_remain = info->size;
+        return;
+    }
+    free_fileinfo(info);
+}
+
+// "gzip;q=0.8, br, *;q=0" を解釈し、送ってよい符号化のビットを返す。q=0は拒否、知らない符号化は無視する
+static int accepted_encodings(struct HTTPRequest *req) {
+    char *p;
+    size_t len;
+    int accepted = 0, refused = 0, wildcard = 0, bit, zero;
+
+    p = header_value(req, HDR_ACCEPT_ENCODING);
+    if (!p) {
+        return 0;
+    }
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            break;
+        }
+        len = strcspn(p, " \t;,");
+        if (len == 4 && strncasecmp(p, "gzip", 4) == 0) {
+            bit = 1 << ENC_GZIP;
+        } else if (len == 2 && strncasecmp(p, "br", 2) == 0) {
+            bit = 1 << ENC_BR;
+        } else if (len == 1 && *p == '*') {
+            bit = -1;
+        } else {
+            bit = 0;
+        }
+        p += len;
+
+        zero = 0;
+        for (;;) {
+            p += strspn(p, " \t;");
+            if (*p == '\0' || *p == ',') {
+                break;
+            }
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                zero = strtod(p + 2, NULL) <= 0.0;
+            }
+            p += strcspn(p, ";,");
+        }
+
+        if (bit == -1) {
+            wildcard = !zero;
+        } else if (zero) {
+            refused |= bit;
+        } else {
+            accepted |= bit;
+        }
+    }
+    if (wildcard) {
+        accepted |= ((1 << ENC_COUNT) - 1) & ~(1 << ENC_IDENTITY) & ~refused;
+    }
+    return accepted & ~refused;
+}
+
+// 前の範囲と重なるか接する範囲はまとめる。それでも重なりが残るか合計がファイルより大きければ0（全体を返す）
+static int coalesce_ranges(struct ByteRange *ranges, int n, off_t size) {
+    off_t total = 0;
+    int i, j, m = 0;
+
+    for (i = 0; i < n; i++) {
+        if (m > 0 && ranges[i].first <= ranges[m - 1].last + 1 && ranges[i].last + 1 >= ranges[m - 1].first) {
+            if (ranges[i].first < ranges[m - 1].first) {
+                ranges[m - 1].first = ranges[i].first;
+            }
+            if (ranges[i].last > ranges[m - 1].last) {
+                ranges[m - 1].last = ranges[i].last;
+            }
+            continue;
+        }
+        ranges[m++] = ranges[i];
+    }
+    for (i = 0; i < m; i++) {
+        total += ranges[i].last - ranges[i].first + 1;
+        for (j = 0; j < i; j++) {
+            if (ranges[i].first <= ranges[j].last && ranges[j].first <= ranges[i].last) {
+                log_error("overlapping ranges; sending the whole file");
+                return 0;
+            }
+        }
+    }
+    if (total > size) {
+        log_error("ranges larger than the file; sending the whole file");
+        return 0;
+    }
+    return m;
+}
+
+// "bytes=0-99,200-,-500" を解釈する。Rangeがない・解釈できない場合は0（全体を返す）、
+// 満たせる範囲がひとつもなければ-1、それ以外は範囲の数を返す
+static int parse_range(struct HTTPRequest *req, struct FileInfo *info, struct ByteRange *ranges) {
+    char *p, *end, *cond;
+    long long first, last;
+    off_t size = info->size;
+    int n = 0;
+
+    p = header_value(req, HDR_RANGE);
+    if (!p || strcmp(req->method, "GET") != 0) {
+        return 0;
+    }
+    // If-Rangeの検証子が今のファイルと一致しなければ全体を返す。ETagは強い比較、日付は完全一致で比べる
+    if ((cond = header_value(req, HDR_IF_RANGE)) != NULL) {
+        if (cond[0] == '"' || cond[0] == 'W') {
+            if (etag_matches(cond, info, 0) < 0) {
+                return 0;
+            }
+        } else if (parse_http_date(cond) != info->mtime) {
+            return 0;
+        }
+    }
+    if (strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    p += 6;
+
+    for (;;) {
+        p += strspn(p, " \t");
+        if (*p == '-') {
+            // 末尾からのバイト数
+            last = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || last < 0) {
+                return 0;
+            }
+            if (last > 0 && size > 0) {
+                first = last >= size ? 0 : size - last;
+                last = size - 1;
+            } else {
+                first = -1;
+            }
+        } else {
+            first = strtoll(p, &end, 10);
+            if (end == p || first < 0 || *end != '-') {
+                return 0;
+            }
+            p = end + 1;
+            if (*p >= '0' && *p <= '9') {
+                last = strtoll(p, &end, 10);
+                if (last < first) {
+                    return 0;
+                }
+            } else {
+                last = size - 1;
+                end = p;
+            }
+            if (first >= size) {
+                first = -1;
+            } else if (last >= size) {
+                last = size - 1;
+            }
+        }
+
+        if (first >= 0) {
+            if (n == MAX_RANGES) {
+                log_error("too many ranges; sending the whole file");
+                return 0;
+            }
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+
+        p = end + strspn(end, " \t");
+        if (*p == '\0') {
+            break;
+        }
+        if (*p != ',') {
+            return 0;
+        }
+        p++;
+    }
+    return n > 0 ? coalesce_ranges(ranges, n, size) : -1;
+}
+
+static void out_content_range(struct OutputBuffer *out, struct ByteRange *range, off_t size) {
+    out_puts(out, "Content-Range: bytes ");
+    out_put_long(out, range->first);
+    out_puts(out, "-");
+    out_put_long(out, range->last);
+    out_puts(out, "/");
+    out_put_long(out, size);
+    out_puts(out, "\r\n");
+}
+
+// 1つの範囲ならファイルのその位置から直接送る。複数なら multipart/byteranges のパートとして並べる
+static void respond_ranges(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info,
+                           struct ByteRange *ranges, int nranges) {
+    struct OutputBuffer *out = &conn->out;
+    char boundary[32];
+    off_t total = 0;
+    size_t start;
+    int i;
+
+    output_common_header_fileds(req, out, "206 Partial Content");
+    out_puts(out, "Accept-Ranges: bytes\r\n");
+    out_validators(out, info, ENC_IDENTITY);
+
+    if (nranges == 1) {
+        out_content_range(out, &ranges[0], info->size);
+        out_puts(out, "Content-Length: ");
+        out_put_long(out, ranges[0].last - ranges[0].first + 1);
+        out_puts(out, "\r\nContent-Type: ");
+        out_puts(out, info->content_type);
+        out_puts(out, "\r\n\r\n");
+        conn->body_info = info;
+        conn->body_fd = info->fd;
+        conn->body_offset = ranges[0].first;
+        conn->body_remain = ranges[0].last - ranges[0].first + 1;
+        return;
+    }
+
+    snprintf(boundary, sizeof boundary, "%08lx%08lx", (unsigned long) time(NULL), (unsigned long) random());
+    if (!conn->parts.data) {
+        conn->parts.cap = OUTPUT_BUF_SIZE;
+        conn->parts.data = xmalloc(conn->parts.cap);
+    }
+    conn->segments = xmalloc(sizeof(struct BodySegment) * (nranges * 2 + 1));
+    for (i = 0; i < nranges; i++) {
+        start = conn->parts.len;
+        out_puts(&conn->parts, i == 0 ? "--" : "\r\n--");
+        out_puts(&conn->parts, boundary);
+        out_puts(&conn->parts, "\r\nContent-Type: ");
+        out_puts(&conn->parts, info->content_type);
+        out_puts(&conn->parts, "\r\n");
+        out_content_range(&conn->parts, &ranges[i], info->size);
+        out_puts(&conn->parts, "\r\n");
+        conn->segments[conn->nsegments].in_memory = 1;
+        conn->segments[conn->nsegments].offset = start;
+        conn->segments[conn->nsegments].length = conn->parts.len - start;
+        conn->nsegments++;
+
+        conn->segments[conn->nsegments].in_memory = 0;
+        conn->segments[conn->nsegments].offset = ranges[i].first;
+        conn->segments[conn->nsegments].length = ranges[i].last - ranges[i].first + 1;
+        conn->nsegments++;
+    }
+    start = conn->parts.len;
+    out_puts(&conn->parts, "\r\n--");
+    out_puts(&conn->parts, boundary);
+    out_puts(&conn->parts, "--\r\n");
+    conn->segments[conn->nsegments].in_memory = 1;
+    conn->segments[conn->nsegments].offset = start;
+    conn->segments[conn->nsegments].length = conn->parts.len - start;
+    conn->nsegments++;
+
+    for (i = 0; i < conn->nsegments; i++) {
+        total += conn->segments[i].length;
+    }
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, total);
+    out_puts(out, "\r\nContent-Type: multipart/byteranges; boundary=");
+    out_puts(out, boundary);
+    out_puts(out, "\r\n\r\n");
+
+    conn->body_info = info;
+    conn->body_fd = info->fd;
+    conn->body_offset = conn->segments[0].offset;
+    conn->body_remain = conn->segments[0].length;
+}
+
+static void range_not_satisfiable(struct HTTPRequest *req, struct OutputBuffer *out, struct FileInfo *info) {
+    output_common_header_fileds(req, out, "416 Range Not Satisfiable");
+    out_puts(out, "Content-Range: bytes */");
+    out_put_long(out, info->size);
+    out_puts(out, "\r\nContent-Length: ");
+    out_put_long(out, strlen("range_not_satisfiable\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "range_not_satisfiable\r\n");
+}
+
+// すべてのワーカーの統計を足し合わせる。各項目は別々に読むので、厳密に同じ瞬間の値ではない
+static void sum_worker_stats(struct WorkerStats *total) {
+    struct WorkerStats *w;
+    int i, j, k;
+
+    memset(total, 0, sizeof *total);
+    for (i = 0; i < (workers > 0 ? workers : 1); i++) {
+        w = &worker_stats[i];
+        total->accepted += __atomic_load_n(&w->accepted, __ATOMIC_RELAXED);
+        total->file_cache_hits += __atomic_load_n(&w->file_cache_hits, __ATOMIC_RELAXED);
+        total->file_cache_misses += __atomic_load_n(&w->file_cache_misses, __ATOMIC_RELAXED);
+        total->hot_cache_hits += __atomic_load_n(&w->hot_cache_hits, __ATOMIC_RELAXED);
+        total->hot_cache_bytes += __atomic_load_n(&w->hot_cache_bytes, __ATOMIC_RELAXED);
+        total->compressed_responses += __atomic_load_n(&w->compressed_responses, __ATOMIC_RELAXED);
+        total->gzip_cache_bytes += __atomic_load_n(&w->gzip_cache_bytes, __ATOMIC_RELAXED);
+        total->pool_tasks += __atomic_load_n(&w->pool_tasks, __ATOMIC_RELAXED);
+        total->requests += __atomic_load_n(&w->requests, __ATOMIC_RELAXED);
+        total->bytes_sent += __atomic_load_n(&w->bytes_sent, __ATOMIC_RELAXED);
+        total->access_log_lines += __atomic_load_n(&w->access_log_lines, __ATOMIC_RELAXED);
+        total->access_log_dropped += __atomic_load_n(&w->access_log_dropped, __ATOMIC_RELAXED);
+        for (j = 0; j < TIMEOUT_KINDS; j++) {
+            total->timeouts[j] += __atomic_load_n(&w->timeouts[j], __ATOMIC_RELAXED);
+        }
+        total->uploads += __atomic_load_n(&w->uploads, __ATOMIC_RELAXED);
+        total->upload_bytes += __atomic_load_n(&w->upload_bytes, __ATOMIC_RELAXED);
+        total->listing_renders += __atomic_load_n(&w->listing_renders, __ATOMIC_RELAXED);
+        total->handler_calls += __atomic_load_n(&w->handler_calls, __ATOMIC_RELAXED);
+        total->handler_failures += __atomic_load_n(&w->handler_failures, __ATOMIC_RELAXED);
+        for (j = 0; j < 6; j++) {
+            total->status[j] += __atomic_load_n(&w->status[j], __ATOMIC_RELAXED);
+        }
+        for (j = 0; j < STAGE_COUNT; j++) {
+            total->stages[j].count += __atomic_load_n(&w->stages[j].count, __ATOMIC_RELAXED);
+            total->stages[j].sum_us += __atomic_load_n(&w->stages[j].sum_us, __ATOMIC_RELAXED);
+            for (k = 0; k < HIST_BUCKETS; k++) {
+                total->stages[j].buckets[k] += __atomic_load_n(&w->stages[j].buckets[k], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// 数え終わった直近RATE_WINDOW-1秒間の平均
+static double recent_rate(void) {
+    long now = (long) time(NULL);
+    unsigned long n = 0;
+    long sec;
+    int i, j;
+
+    for (i = 0; i < (workers > 0 ? workers : 1); i++) {
+        for (j = 0; j < RATE_WINDOW; j++) {
+            sec = __atomic_load_n(&worker_stats[i].rate_second[j], __ATOMIC_RELAXED);
+            if (sec < now && sec > now - RATE_WINDOW) {
+                n += __atomic_load_n(&worker_stats[i].rate_count[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return (double) n / (RATE_WINDOW - 1);
+}
+
+// q番目の値が入っているバケットの上端を返す
+static unsigned long hist_percentile(struct LatencyHistogram *h, double q) {
+    unsigned long total = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += h->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = (unsigned long) (q * total);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            return hist_bucket_floor(i + 1) - 1;
+        }
+    }
+    return hist_bucket_floor(HIST_BUCKETS - 1);
+}
+
+// 1項目を書く。テキストは「名前 値」の1行、JSONは"名前":値
+static void put_stat(struct OutputBuffer *out, int json, const char *name, const char *fmt, ...) {
+    char buf[64];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (json) {
+        out_puts(out, out->len > 1 ? ",\"" : "\"");
+        out_puts(out, name);
+        out_puts(out, "\":");
+        out_puts(out, buf);
+    } else {
+        out_puts(out, name);
+        out_puts(out, " ");
+        out_puts(out, buf);
+        out_puts(out, "\n");
+    }
+}
+
+static void put_stage_stats(struct OutputBuffer *out, int json, const char *stage, struct LatencyHistogram *h) {
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {{"p50", 0.5}, {"p99", 0.99}, {"p999", 0.999}};
+    char name[64];
+    int i;
+
+    snprintf(name, sizeof name, "stage_%s_count", stage);
+    put_stat(out, json, name, "%lu", h->count);
+    snprintf(name, sizeof name, "stage_%s_mean_us", stage);
+    put_stat(out, json, name, "%lu", h->count ? h->sum_us / h->count : 0);
+    for (i = 0; i < (int) (sizeof percentiles / sizeof percentiles[0]); i++) {
+        snprintf(name, sizeof name, "stage_%s_%s_us", stage, percentiles[i].name);
+        put_stat(out, json, name, "%lu", hist_percentile(h, percentiles[i].q));
+    }
+}
+
+// 全ワーカーの統計を返す。?format=jsonならJSON、それ以外は1行1項目のテキスト
+static void respond_stats(struct HTTPRequest *req, struct OutputBuffer *out) {
+    static struct WorkerStats total;
+    static const char *status_names[6] = {"status_other", "status_1xx", "status_2xx", "status_3xx", "status_4xx",
+                                          "status_5xx"};
+    struct OutputBuffer body;
+    char *query = strchr(req->path, '?');
+    int json = query && strstr(query, "format=json") != NULL;
+    unsigned long counters[LISTEN_COUNTERS];
+    struct tcp_info tcpi;
+    socklen_t tcpi_len = sizeof tcpi;
+    int i;
+
+    sum_worker_stats(&total);
+    body.cap = LINE_BUF_SIZE;
+    body.data = xmalloc(body.cap);
+    body.len = 0;
+    if (json) {
+        out_puts(&body, "{");
+    }
+    put_stat(&body, json, "uptime_seconds", "%ld", (long) (time(NULL) - start_time));
+    put_stat(&body, json, "workers", "%d", workers > 0 ? workers : 1);
+    put_stat(&body, json, "connections_accepted", "%lu", total.accepted);
+    put_stat(&body, json, "requests", "%lu", total.requests);
+    put_stat(&body, json, "requests_per_second", "%.2f", recent_rate());
+    put_stat(&body, json, "bytes_sent", "%lu", total.bytes_sent);
+    for (i = 1; i <= 5; i++) {
+        put_stat(&body, json, status_names[i], "%lu", total.status[i]);
+    }
+    put_stat(&body, json, status_names[0], "%lu", total.status[0]);
+    put_stat(&body, json, "file_cache_hits", "%lu", total.file_cache_hits);
+    put_stat(&body, json, "file_cache_misses", "%lu", total.file_cache_misses);
+    put_stat(&body, json, "hot_cache_hits", "%lu", total.hot_cache_hits);
+    put_stat(&body, json, "hot_cache_bytes", "%lu", total.hot_cache_bytes);
+    put_stat(&body, json, "compressed_responses", "%lu", total.compressed_responses);
+    put_stat(&body, json, "gzip_cache_bytes", "%lu", total.gzip_cache_bytes);
+    put_stat(&body, json, "io_pool_tasks", "%lu", total.pool_tasks);
+    put_stat(&body, json, "access_log_lines", "%lu", total.access_log_lines);
+    put_stat(&body, json, "access_log_dropped", "%lu", total.access_log_dropped);
+    put_stat(&body, json, "header_timeouts", "%lu", total.timeouts[TIMEOUT_HEADER]);
+    put_stat(&body, json, "body_timeouts", "%lu", total.timeouts[TIMEOUT_BODY]);
+    put_stat(&body, json, "keepalive_timeouts", "%lu", total.timeouts[TIMEOUT_KEEPALIVE]);
+    put_stat(&body, json, "handler_timeouts", "%lu", total.timeouts[TIMEOUT_HANDLER]);
+    put_stat(&body, json, "uploads", "%lu", total.uploads);
+    put_stat(&body, json, "upload_bytes", "%lu", total.upload_bytes);
+    put_stat(&body, json, "listing_renders", "%lu", total.listing_renders);
+    put_stat(&body, json, "handler_calls", "%lu", total.handler_calls);
+    put_stat(&body, json, "handler_failures", "%lu", total.handler_failures);
+    // 受け付けキューの長さは、このリクエストを処理したワーカーのソケットのもの
+    if (accept_fd >= 0 && getsockopt(accept_fd, IPPROTO_TCP, TCP_INFO, &tcpi, &tcpi_len) == 0) {
+        put_stat(&body, json, "listen_queue", "%u", tcpi.tcpi_unacked);
+        put_stat(&body, json, "listen_backlog", "%u", tcpi.tcpi_sacked);
+    }
+    read_listen_counters(counters);
+    put_stat(&body, json, "listen_overflows", "%lu", counters[0]);
+    put_stat(&body, json, "listen_drops", "%lu", counters[1]);
+    put_stat(&body, json, "syn_queue_drops", "%lu", counters[2]);
+    put_stat(&body, json, "syn_cookies_sent", "%lu", counters[3]);
+    for (i = 0; i < STAGE_COUNT; i++) {
+        put_stage_stats(&body, json, stage_names[i], &total.stages[i]);
+    }
+    if (json) {
+        out_puts(&body, "}\n");
+    }
+
+    output_common_header_fileds(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, (long) body.len);
+    out_puts(out, json ? "\r\nContent-Type: application/json\r\n" : "\r\nContent-Type: text/plain\r\n");
+    out_puts(out, "Cache-Control: no-store\r\n\r\n");
+    if (strcmp(req->method, "HEAD") != 0) {
+        out_write(out, body.data, body.len);
+    }
+    free(body.data);
+}
+
+// 一時ファイルを置き換え先へrename(2)して、結果を返す。失敗した時は残りのボディを読まずに接続を閉じる
+static void respond_upload(struct HTTPRequest *req, struct Connection *conn) {
+    char *status, *body;
+
+    if (conn->upload_fd >= 0) {
+        if (close(conn->upload_fd) < 0 || rename(conn->upload_tmp, conn->upload_path) < 0) {
+            log_error("failed to store %s: %s", conn->upload_path, strerror(errno));
+            unlink(conn->upload_tmp);
+            conn->upload_status = 500;
+        } else {
+            __atomic_fetch_add(&my_stats->uploads, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&my_stats->upload_bytes, conn->upload_size, __ATOMIC_RELAXED);
+        }
+        conn->upload_fd = -1;
+    }
+    free(conn->upload_tmp);
+    free(conn->upload_path);
+    conn->upload_tmp = NULL;
+    conn->upload_path = NULL;
+
+    switch (conn->upload_status) {
+        case 201:
+            output_common_header_fileds(req, &conn->out, "201 Created");
+            out_puts(&conn->out, "Content-Length: 0\r\n\r\n");
+            return;
+        case 204:
+            output_common_header_fileds(req, &conn->out, "204 No Content");
+            out_puts(&conn->out, "\r\n");
+            return;
+        case 403:
+            status = "403 Forbidden";
+            body = "forbidden\r\n";
+            break;
+        case 409:
+            status = "409 Conflict";
+            body = "conflict\r\n";
+            break;
+        case 411:
+            status = "411 Length Required";
+            body = "length_required\r\n";
+            break;
+        default:
+            status = "500 Internal Server Error";
+            body = "internal_server_error\r\n";
+            break;
+    }
+    req->keep_alive = 0;
+    conn->keep_alive = 0;
+    output_common_header_fileds(req, &conn->out, status);
+    out_puts(&conn->out, "Content-Length: ");
+    out_put_long(&conn->out, (long) strlen(body));
+    out_puts(&conn->out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(&conn->out, body);
+}
+
+static void method_not_allowed(struct HTTPRequest *req, struct OutputBuffer *out) {
+    output_common_header_fileds(req, out, "405 Method Not Allowed");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, strlen("method_not_allowed\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "method_not_allowed\r\n");
+}
+
+static void not_implemented(struct HTTPRequest *req, struct OutputBuffer *out) {
+    output_common_header_fileds(req, out, "501 Not Implemented");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, strlen("not_implemented\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "not_implemented\r\n");
+}
+
+static void bad_request(struct HTTPRequest *req, struct OutputBuffer *out) {
+    output_common_header_fileds(req, out, "400 Bad Request");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, strlen("bad_request\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "bad_request\r\n");
+}
+
+static void not_found(struct HTTPRequest *req, struct OutputBuffer *out) {
+    output_common_header_fileds(req, out, "404 Not Found");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, strlen("not_found\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "not_found\r\n");
+}
+
+static void bad_gateway(struct HTTPRequest *req, struct OutputBuffer *out) {
+    __atomic_fetch_add(&my_stats->handler_failures, 1, __ATOMIC_RELAXED);
+    output_common_header_fileds(req, out, "502 Bad Gateway");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, strlen("bad_gateway\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "bad_gateway\r\n");
+}
+
+static int read_full(int fd, char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// forkするサーバでは、ハンドラに繋いで応答が返るまでブロックする。呼び出しは1つずつなのでidは使わない
+static void call_handler_blocking(struct Connection *conn, struct HTTPRequest *req) {
+    struct timeval timeout = {HANDLER_TIMEOUT, 0};
+    struct sockaddr_un addr;
+    struct HandlerFrame frame;
+    struct OutputBuffer buf;
+    socklen_t len;
+    int fd;
+
+    __atomic_fetch_add(&my_stats->handler_calls, 1, __ATOMIC_RELAXED);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("socket(2) failed: %s", strerror(errno));
+        return;
+    }
+    len = handler_address(&addr, getpid() % handler_procs);
+    if (connect(fd, (struct sockaddr *) &addr, len) < 0) {
+        log_error("failed to connect to handler: %s", strerror(errno));
+        close(fd);
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    buf.cap = OUTPUT_BUF_SIZE;
+    buf.data = xmalloc(buf.cap);
+    buf.len = 0;
+    put_handler_request(&buf, req, 1);
+    errno = 0;
+    if (send(fd, buf.data, buf.len, MSG_NOSIGNAL) == (ssize_t) buf.len
+        && read_full(fd, (char *) &frame, sizeof frame) == 0 && frame.len <= MAX_HANDLER_REPLY) {
+        conn->reply = xmalloc(frame.len + 1);
+        if (read_full(fd, conn->reply, frame.len) == 0) {
+            conn->reply_len = frame.len;
+        } else {
+            free(conn->reply);
+            conn->reply = NULL;
+        }
+    }
+    if (!conn->reply) {
+        if (WOULD_BLOCK(errno)) {
+            count_timeout(TIMEOUT_HANDLER);
+        }
+        log_error("no reply from handler for %s", req->path);
+    }
+    free(buf.data);
+    close(fd);
+}
+
+// 応答はCGIと同じく、ヘッダ・空行・ボディの順。Status:がなければ200とし、
+// 長さとコネクションの扱いはこちらで決めるので、Content-LengthとConnectionは捨てる
+static void respond_dynamic(struct HTTPRequest *req, struct Connection *conn) {
+    struct OutputBuffer *out = &conn->out;
+    char *reply, *end, *line, *next, *colon;
+    char status[64] = "200 OK";
+    size_t header_len;
+
+    if (!conn->replied) {
+        call_handler_blocking(conn, req);
+    }
+    reply = conn->reply;
+    conn->reply = NULL;
+    conn->replied = 0;
+    if (!reply) {
+        bad_gateway(req, out);
+        return;
+    }
+    reply[conn->reply_len] = '\0';
+    end = memmem(reply, conn->reply_len, "\r\n\r\n", 4);
+    if (!end) {
+        log_error("malformed reply from handler for %s", req->path);
+        free(reply);
+        bad_gateway(req, out);
+        return;
+    }
+    header_len = end - reply + 4;
+    *end = '\0';
+    for (line = reply; line; line = next) {
+        next = strstr(line, "\r\n");
+        if (next) {
+            *next = '\0';
+            next += 2;
+        }
+        colon = strchr(line, ':');
+        if (colon && colon - line == 6 && strncasecmp(line, "Status", 6) == 0) {
+            colon += strspn(colon + 1, " \t") + 1;
+            if (!isdigit((unsigned char) colon[0]) || !isdigit((unsigned char) colon[1])
+                || !isdigit((unsigned char) colon[2]) || strlen(colon) >= sizeof status) {
+                log_error("bad status from handler for %s: %s", req->path, colon);
+                free(reply);
+                bad_gateway(req, out);
+                return;
+            }
+            strcpy(status, colon);
+        }
+    }
+    output_common_header_fileds(req, out, status);
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, (long) (conn->reply_len - header_len));
+    out_puts(out, "\r\n");
+    // 区切りの'\0'を飛ばしながらもう一度たどる
+    for (line = reply; line < end; line += strlen(line) + 2) {
+        colon = strchr(line, ':');
+        if (!colon || line[0] == '\0') {
+            continue;
+        }
+        *colon = '\0';
+        if (strcasecmp(line, "Status") != 0 && strcasecmp(line, "Content-Length") != 0
+            && strcasecmp(line, "Connection") != 0 && strcasecmp(line, "Transfer-Encoding") != 0) {
+            *colon = ':';
+            out_puts(out, line);
+            out_puts(out, "\r\n");
+        }
+        *colon = ':';
+    }
+    out_puts(out, "\r\n");
+    if (strcmp(req->method, "HEAD") != 0) {
+        out_write(out, reply + header_len, conn->reply_len - header_len);
+    }
+    free(reply);
+}
+
+static char *build_fspath(char *docroot, char *urlpath) {
+    char *path;
+    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
+    sprintf(path, "%s%s", docroot, urlpath);
+    return path;
+}
+
+static void moved_to_directory(struct HTTPRequest *req, struct OutputBuffer *out) {
+    output_common_header_fileds(req, out, "301 Moved Permanently");
+    out_puts(out, "Location: ");
+    out_puts(out, req->path);
+    out_puts(out, "/\r\nContent-Length: ");
+    out_put_long(out, strlen("moved_permanently\r\n"));
+    out_puts(out, "\r\nContent-Type: text/plain\r\n\r\n");
+    out_puts(out, "moved_permanently\r\n");
+}
+
+static void html_escape(struct OutputBuffer *out, const char *s) {
+    const char *run = s;
+
+    for (; *s; s++) {
+        const char *ref = NULL;
+
+        switch (*s) {
+            case '&': ref = "&amp;"; break;
+            case '<': ref = "&lt;"; break;
+            case '>': ref = "&gt;"; break;
+            case '"': ref = "&quot;"; break;
+        }
+        if (ref) {
+            out_write(out, run, s - run);
+            out_puts(out, ref);
+            run = s + 1;
+        }
+    }
+    out_write(out, run, s - run);
+}
+
+static void url_escape(struct OutputBuffer *out, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    char esc[3];
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            out_write(out, s, 1);
+        } else {
+            esc[0] = '%';
+            esc[1] = hex[c >> 4];
+            esc[2] = hex[c & 15];
+            out_write(out, esc, 3);
+        }
+    }
+}
+
+// 溜まった分をfdへ書き出して空にする
+static int flush_listing(int fd, struct OutputBuffer *buf) {
+    if (write_all(fd, buf->data, buf->len) < 0) {
+        return -1;
+    }
+    buf->len = 0;
+    return 0;
+}
+
+// ディレクトリの一覧をHTMLにしてmemfdへ書く。エントリが多くてもLISTING_FLUSHごとに書き出すので
+// メモリ上には一度に一部しか持たない。並べ替えもreaddir(3)の順のまま
+static struct FileInfo *render_listing(char *dirpath, char *urlpath, struct stat *dirst) {
+    struct OutputBuffer buf;
+    struct FileInfo *info;
+    struct dirent *ent;
+    struct stat st;
+    struct tm tm;
+    char date[32];
+    DIR *dir;
+    int fd, err = 0, is_dir;
+    off_t size;
+
+    dir = opendir(dirpath);
+    if (!dir) {
+        log_error("opendir(3) failed on %s: %s", dirpath, strerror(errno));
+        return NULL;
+    }
+    fd = memfd_create("listing", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("memfd_create(2) failed: %s", strerror(errno));
+        closedir(dir);
+        return NULL;
+    }
+    buf.cap = LISTING_FLUSH + LINE_BUF_SIZE;
+    buf.data = xmalloc(buf.cap);
+    buf.len = 0;
+
+    out_puts(&buf, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ");
+    html_escape(&buf, urlpath);
+    out_puts(&buf, "</title></head>\n<body>\n<h1>Index of ");
+    html_escape(&buf, urlpath);
+    out_puts(&buf, "</h1>\n<pre>\n");
+    if (strcmp(urlpath, "/") != 0) {
+        out_puts(&buf, "<a href=\"../\">../</a>\n");
+    }
+    while (!err && (ent = readdir(dir)) != NULL) {
+        // 隠しファイルとアップロード中の一時ファイル(.upload.XXXXXX)は載せない
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        is_dir = S_ISDIR(st.st_mode);
+        out_puts(&buf, "<a href=\"");
+        url_escape(&buf, ent->d_name);
+        out_puts(&buf, is_dir ? "/\">" : "\">");
+        html_escape(&buf, ent->d_name);
+        out_puts(&buf, is_dir ? "/</a>  " : "</a>  ");
+        strftime(date, sizeof date, "%d-%b-%Y %H:%M", gmtime_r(&st.st_mtime, &tm));
+        out_puts(&buf, date);
+        out_puts(&buf, "  ");
+        if (is_dir) {
+            out_puts(&buf, "-");
+        } else {
+            out_put_long(&buf, st.st_size);
+        }
+        out_puts(&buf, "\n");
+        if (buf.len >= LISTING_FLUSH) {
+            err = flush_listing(fd, &buf);
+        }
+    }
+    out_puts(&buf, "</pre>\n</body></html>\n");
+    if (!err) {
+        err = flush_listing(fd, &buf);
+    }
+    closedir(dir);
+    free(buf.data);
+    size = lseek(fd, 0, SEEK_CUR);
+    if (err || size < 0) {
+        log_error("failed to write listing of %s: %s", dirpath, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    info = new_fileinfo(dirpath, "");
+    info->fd = fd;
+    info->content_type = "text/html; charset=utf-8";
+    // 検証子はディレクトリのinodeと更新時刻から作るので、中身が変わらなければ304を返せる
+    set_fileinfo_stat(info, dirst->st_ino, size, dirst->st_mtim.tv_sec, dirst->st_mtim.tv_nsec);
+    __atomic_fetch_add(&my_stats->listing_renders, 1, __ATOMIC_RELAXED);
+    return info;
+}
+
+static unsigned int path_hash(char *path);
+
+static struct Listing *listing_slot(char *path) {
+    return &listings[path_hash(path) % LISTING_CACHE_SIZE];
+}
+
+// 描画した一覧がstのディレクトリの今の中身を表しているか。更新時刻が同じでも、更新と同じ時刻の刻みの中で
+// 描画を始めたものは後の変更を見逃しているかもしれないので使わない。ナノ秒が0なら秒単位の時刻とみなす。
+// スレッドからも呼ぶのでlのpathとinfoは見ない
+static int listing_matches(struct Listing *l, struct stat *st) {
+    struct timespec res;
+    long long slack, age;
+
+    if (l->dev != st->st_dev || l->ino != st->st_ino
+        || l->mtime.tv_sec != st->st_mtim.tv_sec || l->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+        return 0;
+    }
+    if (st->st_mtim.tv_nsec == 0 || clock_getres(CLOCK_REALTIME_COARSE, &res) < 0) {
+        slack = 1000000000LL;
+    } else {
+        slack = res.tv_sec * 1000000000LL + res.tv_nsec;
+    }
+    age = (l->rendered.tv_sec - st->st_mtim.tv_sec) * 1000000000LL + (l->rendered.tv_nsec - st->st_mtim.tv_nsec);
+    return age >= slack;
+}
+
+// pathの所有権とinfoへの参照を1つキャッシュに移す
+static void listing_store(struct Listing *l, char *path, struct stat *st, struct timespec *rendered,
+                          struct FileInfo *info) {
+    if (l->info) {
+        free_fileinfo(l->info);
+    }
+    free(l->path);
+    l->path = path;
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->mtime = st->st_mtim;
+    l->rendered = *rendered;
+    l->info = info;
+    info->refcount++;
+}
+
+// urlpathのディレクトリ一覧の参照を返す。ディレクトリでなければNULL。
+// 更新時刻が前と同じなら描画し直さない
+static struct FileInfo *get_listing(char *docroot, char *urlpath) {
+    struct Listing *l;
+    struct FileInfo *info;
+    struct stat st;
+    struct timespec rendered;
+    char *path;
+
+    path = build_fspath(docroot, urlpath);
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        free(path);
+        return NULL;
+    }
+    l = listing_slot(path);
+    if (l->info && strcmp(l->path, path) == 0 && listing_matches(l, &st)) {
+        free(path);
+        l->info->refcount++;
+        return l->info;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &rendered);
+    info = render_listing(path, urlpath, &st);
+    if (!info) {
+        free(path);
+        return NULL;
+    }
+    listing_store(l, path, &st, &rendered, info);
+    return info;
+}
+
+// スレッドプールが描画しておいた一覧があればそれを使い、なければここで描画する
+static void respond_listing(struct HTTPRequest *req, struct Connection *conn, char *docroot) {
+    struct OutputBuffer *out = &conn->out;
+    struct FileInfo *info;
+    int enc;
+
+    if (conn->listing) {
+        info = conn->listing;
+        conn->listing = NULL;
+    } else {
+        info = get_listing(docroot, req->path);
+    }
+    if (!info) {
+        not_found(req, out);
+        return;
+    }
+    if ((enc = not_modified(req, info)) >= 0) {
+        respond_not_modified(req, out, info, enc);
+        free_fileinfo(info);
+        return;
+    }
+
+    output_common_header_fileds(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_put_long(out, info->size);
+    out_puts(out, "\r\n");
+    out_validators(out, info, ENC_IDENTITY);
+    out_puts(out, "Content-Type: ");
+    out_puts(out, info->content_type);
+    out_puts(out, "\r\n\r\n");
+
+    if (strcmp(req->method, "HEAD") != 0) {
+        conn->body_info = info;
+        conn->body_fd = info->fd;
+        conn->body_offset = 0;
+        conn->body_remain = info->size;
+        return;
+    }
+    free_fileinfo(info);
+}
+
+// 拡張子で引く組み込みの表。bsearch(3)で引くのでextの順に並べておく。同じ拡張子はないのでorderは0のまま使わない
+static const struct MimeType builtin_mime_types[] = {
+        {"7z",    "application/x-7z-compressed"},
+        {"avif",  "image/avif"},
+        {"bmp",   "image/bmp"},
+        {"css",   "text/css; charset=utf-8"},
+        {"csv",   "text/csv; charset=utf-8"},
+        {"gif",   "image/gif"},
+        {"gz",    "application/gzip"},
+        {"htm",   "text/html; charset=utf-8"},
+        {"html",  "text/html; charset=utf-8"},
+        {"ico",   "image/vnd.microsoft.icon"},
+        {"jpeg",  "image/jpeg"},
+        {"jpg",   "image/jpeg"},
+        {"js",    "text/javascript; charset=utf-8"},
+        {"json",  "application/json"},
+        {"map",   "application/json"},
+        {"md",    "text/markdown; charset=utf-8"},
+        {"mjs",   "text/javascript; charset=utf-8"},
+        {"mp3",   "audio/mpeg"},
+        {"mp4",   "video/mp4"},
+        {"ogg",   "audio/ogg"},
+        {"otf",   "font/otf"},
+        {"pdf",   "application/pdf"},
+        {"png",   "image/png"},
+        {"svg",   "image/svg+xml"},
+        {"tar",   "application/x-tar"},
+        {"ttf",   "font/ttf"},
+        {"txt",   "text/plain; charset=utf-8"},
+        {"wasm",  "application/wasm"},
+        {"wav",   "audio/wav"},
+        {"webm",  "video/webm"},
+        {"webp",  "image/webp"},
+        {"woff",  "font/woff"},
+        {"woff2", "font/woff2"},
+        {"xml",   "application/xml"},
+        {"zip",   "application/zip"},
+};
+
+static int compare_mime_type(const void *a, const void *b) {
+    return strcmp(((const struct MimeType *) a)->ext, ((const struct MimeType *) b)->ext);
+}
+
+static int compare_mime_order(const void *a, const void *b) {
+    const struct MimeType *x = a, *y = b;
+    int c = strcmp(x->ext, y->ext);
+
+    return c ? c : (x->order > y->order) - (x->order < y->order);
+}
+
+// パスの拡張子からContent-Typeを決める。表を二分探索するだけで確保はしない
+static const char *guess_content_type(const char *path) {
+    const char *base, *dot;
+    struct MimeType key;
+    const struct MimeType *found = NULL;
+    char ext[MAX_EXTENSION];
+    size_t i;
+
+    base = strrchr(path, '/');
+    dot = strrchr(base ? base : path, '.');
+    if (!dot || dot[1] == '\0' || strlen(dot + 1) >= sizeof ext) {
+        return DEFAULT_CONTENT_TYPE;
+    }
+    for (i = 0; dot[i + 1]; i++) {
+        ext[i] = tolower((unsigned char) dot[i + 1]);
+    }
+    ext[i] = '\0';
+    key.ext = ext;
+    if (extra_mime_count > 0) {
+        found = bsearch(&key, extra_mime_types, extra_mime_count, sizeof(struct MimeType), compare_mime_type);
+    }
+    if (!found) {
+        found = bsearch(&key, builtin_mime_types, sizeof builtin_mime_types / sizeof builtin_mime_types[0],
+                        sizeof(struct MimeType), compare_mime_type);
+    }
+    return found ? found->type : DEFAULT_CONTENT_TYPE;
+}
+
+// "type ext1 ext2 ..." の並んだmime.types形式のファイルを読み、起動時に一度だけ表を作る。
+// 同じ拡張子が何度も出てきたら後の行を使う
+static int load_mime_types(char *path) {
+    FILE *f;
+    char *line = NULL, *type, *ext, *save;
+    size_t cap = 0, n = 0, alloc = 0, i, j;
+
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (getline(&line, &cap, f) >= 0) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        type = strtok_r(line, " \t", &save);
+        if (!type) {
+            continue;
+        }
+        type = strdup(type);
+        if (!type) {
+            log_exit("failed to allocate memory");
+        }
+        while ((ext = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (strlen(ext) >= MAX_EXTENSION) {
+                continue;
+            }
+            for (i = 0; ext[i]; i++) {
+                ext[i] = tolower((unsigned char) ext[i]);
+            }
+            if (n == alloc) {
+                alloc = alloc ? alloc * 2 : 256;
+                extra_mime_types = realloc(extra_mime_types, alloc * sizeof(struct MimeType));
+                if (!extra_mime_types) {
+                    log_exit("failed to allocate memory");
+                }
+            }
+            extra_mime_types[n].ext = strdup(ext);
+            extra_mime_types[n].type = type;
+            extra_mime_types[n].order = n;
+            if (!extra_mime_types[n].ext) {
+                log_exit("failed to allocate memory");
+            }
+            n++;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    // 並べ替えた後で、同じ拡張子のうち最後に出てきたものだけを残す
+    qsort(extra_mime_types, n, sizeof(struct MimeType), compare_mime_order);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && strcmp(extra_mime_types[j - 1].ext, extra_mime_types[i].ext) == 0) {
+            j--;
+        }
+        extra_mime_types[j++] = extra_mime_types[i];
+    }
+    extra_mime_count = j;
+    return 0;
+}
+
+static struct FileInfo *new_fileinfo(char *docroot, char *urlpath) {
+    struct FileInfo *info;
+
+    info = xmalloc(sizeof(struct FileInfo));
+    // "/"で終わるパスはそのディレクトリのindex.htmlを表す
+    if (*urlpath && urlpath[strlen(urlpath) - 1] == '/') {
+        info->path = xmalloc(strlen(docroot) + strlen(urlpath) + sizeof INDEX_FILE);
+        sprintf(info->path, "%s%s%s", docroot, urlpath, INDEX_FILE);
+    } else {
+        info->path = build_fspath(docroot, urlpath);
+    }
+    info->content_type = guess_content_type(info->path);
+    info->ok = 0;
+    info->is_dir = 0;
+    info->fd = -1;
+    info->refcount = 1;
+    info->cached = 0;
+    info->content = NULL;
+    info->gzip = NULL;
+    info->gzip_useless = 0;
+    info->variants_checked = 0;
+    memset(info->variants, 0, sizeof info->variants);
+    return info;
+}
+
+// 通常のファイルだと分かった時に、stat(2)かstatx(2)の結果を設定する
+static void format_etag(char *buf, unsigned long ino, long size, time_t sec, long nsec) {
+    snprintf(buf, ETAG_SIZE, "\"%lx-%lx-%llx\"", ino, (unsigned long) size,
+             (unsigned long long) sec * 1000000000ULL + nsec);
+}
+
+static void set_fileinfo_stat(struct FileInfo *info, unsigned long ino, long size, time_t sec, long nsec) {
+    info->ok = 1;
+    info->size = size;
+    info->mtime = sec;
+    format_etag(info->etag, ino, size, sec, nsec);
+    format_http_date(info->mtime, info->last_modified);
+}
+
+// 調べた後にファイルが書き換えられたり置き換えられたりしていれば1を返す。ETagはinode・サイズ・更新時刻から作るので、それで比べる
+static int fileinfo_changed(struct FileInfo *info) {
+    struct stat st;
+    char etag[ETAG_SIZE];
+
+    if (lstat(info->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    format_etag(etag, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    return strcmp(etag, info->etag) != 0;
+}
+
+static struct FileInfo *stat_fileinfo(char *docroot, char *urlpath) {
+    struct FileInfo *info;
+    struct stat st;
+
+    info = new_fileinfo(docroot, urlpath);
+    if (lstat(info->path, &st) < 0) {
+        return info;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        info->is_dir = S_ISDIR(st.st_mode);
+        return info;
+    }
+    set_fileinfo_stat(info, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    return info;
+}
+
+static struct FileInfo *file_cache_lookup(struct FileCache *cache, char *urlpath);
+
+static void file_cache_insert(struct FileCache *cache, char *urlpath, struct FileInfo *info);
+
+// キャッシュがあればパスの解決もlstat(2)もせずに返す。返した参照はfree_fileinfo()で手放す
+static struct FileInfo *get_fileinfo(char *docroot, char *urlpath) {
+    struct FileInfo *info;
+
+    if (!file_cache) {
+        return stat_fileinfo(docroot, urlpath);
+    }
+
+    info = file_cache_lookup(file_cache, urlpath);
+    if (info) {
+        __atomic_fetch_add(&my_stats->file_cache_hits, 1, __ATOMIC_RELAXED);
+        info->refcount++;
+        return info;
+    }
+    __atomic_fetch_add(&my_stats->file_cache_misses, 1, __ATOMIC_RELAXED);
+
+    // 開くのは本当にボディを送る時まで遅らせる。304で済めばopen(2)しない
+    info = stat_fileinfo(docroot, urlpath);
+    if (info->ok) {
+        file_cache_insert(file_cache, urlpath, info);
+    }
+    return info;
+}
+
+// urlpathに.gzや.brを付けた兄弟ファイルを探す。infoがキャッシュに入っていれば結果（ないことも）を覚えておく
+static struct FileInfo *encoded_variant(char *docroot, char *urlpath, struct FileInfo *info, int enc) {
+    struct FileInfo *variant;
+    char *path;
+
+    if (info->cached && (info->variants_checked & (1 << enc))) {
+        variant = info->variants[enc];
+        if (variant) {
+            variant->refcount++;
+        }
+        return variant;
+    }
+
+    // "/"で終わるパスならindex.html.gzのようにindex.htmlの兄弟を探す
+    path = xmalloc(strlen(urlpath) + sizeof INDEX_FILE + strlen(encoding_suffixes[enc]));
+    sprintf(path, "%s%s%s", urlpath, urlpath[strlen(urlpath) - 1] == '/' ? INDEX_FILE : "",
+            encoding_suffixes[enc]);
+    variant = get_fileinfo(docroot, path);
+    free(path);
+    if (!variant->ok) {
+        free_fileinfo(variant);
+        variant = NULL;
+    }
+    // get_fileinfo()の追い出しでinfoがキャッシュから外れていることもある
+    if (info->cached) {
+        info->variants_checked |= 1 << enc;
+        info->variants[enc] = variant;
+        if (variant) {
+            variant->refcount++;
+        }
+    }
+    return variant;
+}
+
+static void hot_cache_drop(struct HotCache *cache, struct HotContent *content);
+
+// キャッシュから外れる時に、メモリ上の中身と兄弟ファイルへの参照を手放す
+static void release_derived(struct FileInfo *info) {
+    int enc;
+
+    if (info->content) {
+        hot_cache_drop(hot_cache, info->content);
+    }
+    if (info->gzip) {
+        hot_cache_drop(gzip_cache, info->gzip);
+    }
+    for (enc = 0; enc < ENC_COUNT; enc++) {
+        if (info->variants[enc]) {
+            free_fileinfo(info->variants[enc]);
+            info->variants[enc] = NULL;
+        }
+    }
+    info->variants_checked = 0;
+}
+
+static void free_fileinfo(struct FileInfo *info) {
+    if (--info->refcount > 0) {
+        return;
+    }
+    release_derived(info);
+    if (info->fd >= 0) {
+        close(info->fd);
+    }
+    free(info->path);
+    free(info);
+}
+
+static unsigned int path_hash(char *path) {
+    unsigned int h = 2166136261u;
+
+    for (; *path; path++) {
+        h = (h ^ (unsigned char) *path) * 16777619u;
+    }
+    return h;
+}
+
+static struct FileCache *new_file_cache(size_t capacity) {
+    struct FileCache *cache;
+
+    cache = xmalloc(sizeof(struct FileCache));
+    cache->source.type = SOURCE_INOTIFY;
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0) {
+        log_exit("inotify_init1(2) failed: %s", strerror(errno));
+    }
+    cache->capacity = capacity;
+    cache->count = 0;
+    for (cache->nbuckets = 16; cache->nbuckets < capacity; cache->nbuckets *= 2) {
+        ;
+    }
+    cache->buckets = xmalloc(sizeof(struct FileCacheEntry *) * cache->nbuckets);
+    memset(cache->buckets, 0, sizeof(struct FileCacheEntry *) * cache->nbuckets);
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->dirs = NULL;
+    return cache;
+}
+
+static void lru_unlink(struct FileCache *cache, struct FileCacheEntry *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        cache->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
     } else {
-        not_implemented(req, out);
+        cache->lru_tail = e->lru_prev;
     }
 }
 
-static struct FileInfo *get_fileinfo(char *docroot, char *urlpath);
+static void lru_push_front(struct FileCache *cache, struct FileCacheEntry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = e;
+    } else {
+        cache->lru_tail = e;
+    }
+    cache->lru_head = e;
+}
 
-static void free_fileinfo(struct FileInfo *info);
+static struct FileInfo *file_cache_lookup(struct FileCache *cache, char *urlpath) {
+    struct FileCacheEntry *e;
+    unsigned int hash = path_hash(urlpath);
 
-static void output_common_header_fileds(struct HTTPRequest *req, FILE *out, char *status) {
-    time_t t;
-    struct tm *tm;
-    char buf[LINE_BUF_SIZE];
+    for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->hash_next) {
+        if (e->hash == hash && strcmp(e->key, urlpath) == 0) {
+            lru_unlink(cache, e);
+            lru_push_front(cache, e);
+            return e->info;
+        }
+    }
+    return NULL;
+}
 
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm) {
-        log_exit("gmtime failed: %s", strerror(errno));
+static void drop_watch(struct FileCache *cache, struct WatchDir *dir) {
+    struct WatchDir **d;
+
+    inotify_rm_watch(cache->inotify_fd, dir->wd);
+    for (d = &cache->dirs; *d != dir; d = &(*d)->next) {
+        ;
+    }
+    *d = dir->next;
+    free(dir);
+}
+
+// エントリをキャッシュから外す。送信中の接続が参照していればFileInfoはそちらが解放する
+static void file_cache_remove(struct FileCache *cache, struct FileCacheEntry *e) {
+    struct FileCacheEntry **p;
+    struct WatchDir *dir = e->dir;
+
+    for (p = &cache->buckets[e->hash & (cache->nbuckets - 1)]; *p != e; p = &(*p)->hash_next) {
+        ;
+    }
+    *p = e->hash_next;
+    lru_unlink(cache, e);
+
+    if (e->dir_prev) {
+        e->dir_prev->dir_next = e->dir_next;
+    } else {
+        dir->entries = e->dir_next;
+    }
+    if (e->dir_next) {
+        e->dir_next->dir_prev = e->dir_prev;
+    }
+    // 監視しているファイルがなくなったディレクトリは監視をやめる
+    if (!dir->entries) {
+        drop_watch(cache, dir);
     }
 
-    strftime(buf, LINE_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", 0, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", "super server", "2.3");
-    fprintf(out, "Connection: close\r\n");
+    // 古くなった中身はすぐにホットキャッシュと圧縮キャッシュから外し、予算を空ける
+    e->info->cached = 0;
+    release_derived(e->info);
+    free_fileinfo(e->info);
+    free(e->key);
+    free(e);
+    cache->count--;
 }
 
-static void do_file_respond(struct HTTPRequest *req, FILE *out, char *docroot) {
-    struct FileInfo *info;
+static struct WatchDir *watch_dir(struct FileCache *cache, char *path) {
+    struct WatchDir *dir;
+    int wd;
 
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok) {
-        free_fileinfo(info);
-        not_found(req, out);
+    wd = inotify_add_watch(cache->inotify_fd, path,
+                           IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                           | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+        log_error("inotify_add_watch(2) failed on %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    for (dir = cache->dirs; dir; dir = dir->next) {
+        if (dir->wd == wd) {
+            return dir;
+        }
+    }
+    dir = xmalloc(sizeof(struct WatchDir));
+    dir->wd = wd;
+    dir->entries = NULL;
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+    return dir;
+}
+
+static int fileinfo_changed(struct FileInfo *info);
+
+// 親ディレクトリを監視できた場合だけキャッシュに入れる。監視できないと古い内容を返し続けてしまう。
+// lstat(2)から監視を始めるまでの変更はイベントにならないので、監視を始めてから調べ直して変わっていれば入れない
+static void file_cache_insert(struct FileCache *cache, char *urlpath, struct FileInfo *info) {
+    struct FileCacheEntry *e, **bucket;
+    struct WatchDir *dir;
+    char *slash;
+
+    slash = strrchr(info->path, '/');
+    if (slash && slash != info->path) {
+        *slash = '\0';
+        dir = watch_dir(cache, info->path);
+        *slash = '/';
+    } else {
+        dir = watch_dir(cache, slash ? "/" : ".");
+    }
+    if (!dir) {
+        return;
+    }
+    if (fileinfo_changed(info)) {
+        // 他のエントリがなければ監視も要らない
+        if (!dir->entries) {
+            drop_watch(cache, dir);
+        }
         return;
     }
 
-    output_common_header_fileds(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", "text/plain");
-    //fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
+    if (cache->count >= cache->capacity) {
+        file_cache_remove(cache, cache->lru_tail);
+    }
 
-    if (strcmp(req->method, "HEAD") != 0) {
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
-        size_t result;
+    e = xmalloc(sizeof(struct FileCacheEntry));
+    e->key = xmalloc(strlen(urlpath) + 1);
+    strcpy(e->key, urlpath);
+    e->hash = path_hash(urlpath);
+    e->info = info;
+    info->refcount++;
+    info->cached = 1;
+    e->name = slash ? slash + 1 : info->path;
+
+    bucket = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+    e->hash_next = *bucket;
+    *bucket = e;
+    lru_push_front(cache, e);
+
+    e->dir = dir;
+    e->dir_prev = NULL;
+    e->dir_next = dir->entries;
+    if (dir->entries) {
+        dir->entries->dir_prev = e;
+    }
+    dir->entries = e;
+    cache->count++;
+}
+
+static void file_cache_clear(struct FileCache *cache) {
+    while (cache->lru_head) {
+        file_cache_remove(cache, cache->lru_head);
+    }
+}
+
+// nameがbaseの圧縮済み兄弟（base.gzなど）ならそれを覚えているbaseのエントリも古くなる
+static int affects_entry(char *base, char *name) {
+    size_t len = strlen(base);
+    int enc;
+
+    if (strncmp(base, name, len) != 0) {
+        return 0;
+    }
+    if (name[len] == '\0') {
+        return 1;
+    }
+    for (enc = ENC_GZIP; enc < ENC_COUNT; enc++) {
+        if (strcmp(name + len, encoding_suffixes[enc]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0) {
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
+// 変更のあったファイル名と一致するエントリを捨てる。名前がなければディレクトリごと捨てる
+static void invalidate_watch(struct FileCache *cache, int wd, char *name) {
+    struct WatchDir *dir;
+    struct FileCacheEntry *e, *next;
+
+    for (dir = cache->dirs; dir; dir = dir->next) {
+        if (dir->wd == wd) {
+            break;
+        }
+    }
+    if (!dir) {
+        return;
+    }
+    for (e = dir->entries; e; e = next) {
+        next = e->dir_next;
+        // 最後のエントリを消すとdirも解放されるが、その時にはnextもNULLになっている
+        if (!name || affects_entry(e->name, name)) {
+            file_cache_remove(cache, e);
         }
+    }
+}
 
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0) {
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
+static void handle_inotify_events(struct FileCache *cache) {
+    char buf[INOTIFY_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    for (;;) {
+        n = read(cache->inotify_fd, buf, sizeof buf);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (n == 0) {
-                break;
+            if (!WOULD_BLOCK(errno)) {
+                log_error("failed to read inotify events: %s", strerror(errno));
+            }
+            return;
+        }
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                file_cache_clear(cache);
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                invalidate_watch(cache, ev->wd, NULL);
+            } else if (ev->len > 0) {
+                invalidate_watch(cache, ev->wd, ev->name);
             }
+        }
+    }
+}
+
+static void release_content(struct HotContent *content) {
+    if (--content->refcount == 0) {
+        free(content);
+    }
+}
+
+static unsigned int sketch_index(unsigned int hash, int row) {
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu + 2 * row;
+    hash ^= hash >> 16;
+    return hash & (SKETCH_WIDTH - 1);
+}
+
+static unsigned int sketch_estimate(struct FrequencySketch *sketch, unsigned int hash) {
+    unsigned int min = 255, c;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        c = sketch->counters[row][sketch_index(hash, row)];
+        if (c < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+static unsigned int sketch_increment(struct FrequencySketch *sketch, unsigned int hash) {
+    unsigned char *c;
+    int row, i;
 
-            result = fwrite(buf, 1, n, out);
-            if (result < n) {
-                log_exit("failed to write to socket: result=%d, n=%d", result, n);
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        c = &sketch->counters[row][sketch_index(hash, row)];
+        if (*c < 255) {
+            (*c)++;
+        }
+    }
+    if (++sketch->additions >= SKETCH_RESET_INTERVAL) {
+        for (row = 0; row < SKETCH_DEPTH; row++) {
+            for (i = 0; i < SKETCH_WIDTH; i++) {
+                sketch->counters[row][i] >>= 1;
             }
         }
+        sketch->additions = 0;
+    }
+    return sketch_estimate(sketch, hash);
+}
 
-        close(fd);
+static struct HotCache *new_hot_cache(size_t budget, int admission, unsigned long *bytes_stat) {
+    struct HotCache *cache;
+
+    cache = xmalloc(sizeof(struct HotCache));
+    memset(cache, 0, sizeof(struct HotCache));
+    cache->budget = budget;
+    cache->admission = admission;
+    cache->bytes_stat = bytes_stat;
+    return cache;
+}
+
+static void hot_lru_unlink(struct HotCache *cache, struct HotContent *content) {
+    if (content->lru_prev) {
+        content->lru_prev->lru_next = content->lru_next;
+    } else {
+        cache->lru_head = content->lru_next;
     }
-    fflush(out);
-    free_fileinfo(info);
+    if (content->lru_next) {
+        content->lru_next->lru_prev = content->lru_prev;
+    } else {
+        cache->lru_tail = content->lru_prev;
+    }
+    content->lru_prev = content->lru_next = NULL;
 }
 
-static void method_not_allowed(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fileds(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: %s\r\n", "text/plain");
-    fprintf(out, "\r\n");
-    fprintf(out, "method_not_allowed\r\n");
-    fflush(out);
+static void hot_lru_push_front(struct HotCache *cache, struct HotContent *content) {
+    content->lru_prev = NULL;
+    content->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = content;
+    } else {
+        cache->lru_tail = content;
+    }
+    cache->lru_head = content;
 }
 
-static void not_implemented(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fileds(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: %s\r\n", "text/plain");
-    fprintf(out, "\r\n");
-    fprintf(out, "not_implemented\r\n");
-    fflush(out);
+static size_t content_footprint(struct HotContent *content) {
+    return sizeof(struct HotContent) + content->len + content->header_len + 1;
 }
 
-static void not_found(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fileds(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: %s\r\n", "text/plain");
-    fprintf(out, "\r\n");
-    fprintf(out, "not_found\r\n");
-    fflush(out);
+static void hot_cache_drop(struct HotCache *cache, struct HotContent *content) {
+    hot_lru_unlink(cache, content);
+    cache->bytes -= content_footprint(content);
+    __atomic_store_n(cache->bytes_stat, cache->bytes, __ATOMIC_RELAXED);
+    *content->owner = NULL;
+    content->owner = NULL;
+    release_content(content);
 }
 
-static char *build_fspath(char *docroot, char *urlpath) {
-    char *path;
-    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
-    sprintf(path, "%s%s", docroot, urlpath);
-    return path;
+static void hot_cache_insert(struct HotCache *cache, struct HotContent *content, struct HotContent **owner) {
+    content->owner = owner;
+    *owner = content;
+    hot_lru_push_front(cache, content);
+    cache->bytes += content_footprint(content);
+    __atomic_store_n(cache->bytes_stat, cache->bytes, __ATOMIC_RELAXED);
 }
 
-static struct FileInfo *get_fileinfo(char *docroot, char *urlpath) {
-    struct FileInfo *info;
-    struct stat st;
+// 予算にneedバイトの空きを作る。受け入れ判定ありなら、追い出される側の方が頻繁に使われていれば諦める
+static int hot_cache_reserve(struct HotCache *cache, size_t need, unsigned int freq) {
+    struct HotContent *victim;
 
-    info = xmalloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
-    info->ok = 0;
+    if (need > cache->budget) {
+        return 0;
+    }
+    while (cache->bytes + need > cache->budget) {
+        victim = cache->lru_tail;
+        if (!victim) {
+            return 0;
+        }
+        if (cache->admission && freq <= sketch_estimate(&cache->sketch, victim->hash)) {
+            return 0;
+        }
+        hot_cache_drop(cache, victim);
+    }
+    return 1;
+}
 
-    if (lstat(info->path, &st) < 0) {
-        return info;
+static struct HotContent *new_content(size_t len, const char *headers, size_t header_len) {
+    struct HotContent *content;
+
+    content = xmalloc(sizeof(struct HotContent) + len + header_len + 1);
+    content->refcount = 1;
+    content->owner = NULL;
+    content->hash = 0;
+    content->lru_prev = NULL;
+    content->lru_next = NULL;
+    content->len = len;
+    content->headers = content->data + len;
+    content->header_len = header_len;
+    memcpy(content->headers, headers, header_len + 1);
+    return content;
+}
+
+static int read_whole(struct FileInfo *info, char *buf) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < (size_t) info->size) {
+        n = pread(info->fd, buf + done, info->size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
     }
-    if (!S_ISREG(st.st_mode)) {
-        return info;
+    return 0;
+}
+
+static struct HotContent *load_content(struct FileInfo *info) {
+    struct HotContent *content;
+    char headers[LINE_BUF_SIZE];
+    int len;
+
+    len = snprintf(headers, sizeof headers, "Content-Length: %ld\r\nAccept-Ranges: bytes\r\n"
+                                            "Vary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                                            "Content-Type: %s\r\n\r\n",
+                   info->size, info->etag, info->last_modified, info->content_type);
+    content = new_content(info->size, headers, len);
+    if (read_whole(info, content->data) < 0) {
+        free(content);
+        return NULL;
     }
+    return content;
+}
 
-    info->ok = 1;
-    info->size = st.st_size;
-    return info;
+// 小さいファイルだけを対象に、予算を超える場合は追い出される側より頻繁に使われている時だけ載せる
+static struct HotContent *hot_content(struct FileInfo *info) {
+    struct HotCache *cache = hot_cache;
+    struct HotContent *content;
+    unsigned int freq;
+
+    if (!cache || !info->cached || info->fd < 0 || info->size > HOT_CACHE_MAX_FILE) {
+        return NULL;
+    }
+    if (info->content) {
+        sketch_increment(&cache->sketch, info->content->hash);
+        hot_lru_unlink(cache, info->content);
+        hot_lru_push_front(cache, info->content);
+        return info->content;
+    }
+
+    freq = sketch_increment(&cache->sketch, path_hash(info->path));
+    if (!hot_cache_reserve(cache, sizeof(struct HotContent) + info->size + LINE_BUF_SIZE, freq)) {
+        return NULL;
+    }
+    content = load_content(info);
+    if (!content) {
+        return NULL;
+    }
+    content->hash = path_hash(info->path);
+    hot_cache_insert(cache, content, &info->content);
+    return content;
 }
 
-static void free_fileinfo(struct FileInfo *info) {
-    free(info->path);
-    free(info);
+// 圧縮して得をするのはテキスト系のファイルだけ
+static int compressible(struct FileInfo *info) {
+    static const char *exts[] = {
+            ".txt", ".html", ".htm", ".css", ".js", ".mjs", ".json", ".xml", ".svg", ".csv", ".md",
+            ".c", ".h", ".map", NULL
+    };
+    char *dot, *slash;
+    int i;
+
+    dot = strrchr(info->path, '.');
+    slash = strrchr(info->path, '/');
+    if (!dot || (slash && dot < slash)) {
+        return 0;
+    }
+    for (i = 0; exts[i]; i++) {
+        if (strcasecmp(dot, exts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-static void free_request(struct HTTPRequest *req) {
-    struct HTTPHeaderField *h, *head;
-    head = req->header;
-    while (head) {
-        h = head;
-        head = head->next;
-        free(h->name);
-        free(h->value);
-        free(h);
+// ファイル全体をgzip形式で圧縮する。小さくならなければNULL
+static struct HotContent *deflate_content(struct FileInfo *info) {
+    struct HotContent *content;
+    z_stream zs;
+    char *plain, *packed;
+    char headers[LINE_BUF_SIZE];
+    char etag[ETAG_SIZE + 8];
+    size_t bound;
+    int len, ret;
+
+    if (info->content) {
+        plain = info->content->data;
+    } else {
+        plain = xmalloc(info->size);
+        if (read_whole(info, plain) < 0) {
+            free(plain);
+            return NULL;
+        }
+    }
+
+    memset(&zs, 0, sizeof zs);
+    // windowBitsに16を足すとzlibではなくgzipのヘッダとトレーラを付ける
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_exit("deflateInit2() failed");
+    }
+    bound = deflateBound(&zs, info->size);
+    packed = xmalloc(bound);
+    zs.next_in = (Bytef *) plain;
+    zs.avail_in = info->size;
+    zs.next_out = (Bytef *) packed;
+    zs.avail_out = bound;
+    ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (!info->content) {
+        free(plain);
+    }
+    if (ret != Z_STREAM_END || zs.total_out >= (uLong) info->size) {
+        free(packed);
+        return NULL;
+    }
+
+    encoded_etag(info, ENC_GZIP, etag);
+    len = snprintf(headers, sizeof headers, "Content-Length: %lu\r\nContent-Encoding: gzip\r\n"
+                                            "Vary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                                            "Content-Type: %s\r\n\r\n",
+                   (unsigned long) zs.total_out, etag, info->last_modified, info->content_type);
+    content = new_content(zs.total_out, headers, len);
+    memcpy(content->data, packed, zs.total_out);
+    free(packed);
+    return content;
+}
+
+// 圧縮するのは最初の1回だけで、以降は圧縮キャッシュから返す。追い出しは単純なLRU
+static struct HotContent *gzip_content(struct FileInfo *info) {
+    struct HotCache *cache = gzip_cache;
+    struct HotContent *content;
+
+    if (!cache || !info->cached || info->gzip_useless) {
+        return NULL;
+    }
+    if (info->gzip) {
+        hot_lru_unlink(cache, info->gzip);
+        hot_lru_push_front(cache, info->gzip);
+        return info->gzip;
+    }
+    if (info->size < GZIP_MIN_FILE || info->size > GZIP_MAX_FILE || !compressible(info)) {
+        return NULL;
     }
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
+    if (open_fileinfo(info) < 0) {
+        return NULL;
+    }
+
+    content = deflate_content(info);
+    if (!content) {
+        info->gzip_useless = 1;
+        return NULL;
+    }
+    if (!hot_cache_reserve(cache, content_footprint(content), 0)) {
+        // 予算より大きいものは何度圧縮しても載らない
+        info->gzip_useless = 1;
+        release_content(content);
+        return NULL;
+    }
+    hot_cache_insert(cache, content, &info->gzip);
+    return content;
+}
+
+static void free_request(struct HTTPRequest *req) {
+    arena_reset(req->arena);
 }
 
 static void noop_handler(int sig) { ; }
@@ -596,6 +7275,28 @@ static void detach_children(void) {
     }
 }
 
+// 子プロセスはそれぞれ自分の接続を最後まで処理する。SA_NOCLDWAITなのでwait(2)は全員が終わるまで戻らない
+static void wait_forked_children(void) {
+    struct sigaction act;
+
+    act.sa_handler = noop_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    sigaction(SIGALRM, &act, NULL);
+    // ハンドラの監視プロセスも子プロセスなので、残しておくとwait(2)が戻らない。
+    // 処理中の子プロセスがハンドラを待っていれば502になる
+    if (handler_supervisor) {
+        kill(handler_supervisor, SIGTERM);
+    }
+    alarm(DRAIN_TIMEOUT);
+    while (wait(NULL) > 0 || (errno == EINTR && time(NULL) < drain_deadline)) {
+        ;
+    }
+    if (errno == EINTR) {
+        log_error("drain timed out; leaving the remaining children running");
+    }
+}
+
 static void trap_signal(int sig, sighandler_t handler) {
     struct sigaction act;
     act.sa_handler = handler;
@@ -611,8 +7312,12 @@ static void signal_exit(int sig) {
 }
 
 static void install_signal_handlers(void) {
-    trap_signal(SIGPIPE, signal_exit);
-    detach_children();
+    if (engine != ENGINE_FORK) {
+        // 1プロセスで全接続を扱うので、切断されたクライアントへの書き込みで終了しないようにする
+        trap_signal(SIGPIPE, SIG_IGN);
+    } else {
+        trap_signal(SIGPIPE, signal_exit);
+    }
 }
 
 static void *xmalloc(size_t sz) {
@@ -624,15 +7329,34 @@ static void *xmalloc(size_t sz) {
     return p;
 }
 
-static void log_exit(char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
+static void log_vmessage(int priority, char *fmt, va_list ap) {
     if (debug_mode) {
         vfprintf(stderr, fmt, ap);
         fputc('\n', stderr);
     } else {
-        vsyslog(LOG_ERR, fmt, ap);
+        vsyslog(priority, fmt, ap);
     }
+}
+
+static void log_info(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vmessage(LOG_INFO, fmt, ap);
+    va_end(ap);
+}
+
+// epollモードでは1つの接続のエラーでサーバ全体を落とさないよう、ログだけ出して処理を続ける
+static void log_error(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vmessage(LOG_ERR, fmt, ap);
+    va_end(ap);
+}
+
+static void log_exit(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vmessage(LOG_ERR, fmt, ap);
     va_end(ap);
     exit(1);
 }